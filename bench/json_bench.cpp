@@ -0,0 +1,205 @@
+// tdbot-json-bench <corpus> [rounds]
+//
+// Times append_json_string with each string kernel, and the ways of handing
+// an update to Lua, over the strings of a recorded corpus: one JSON value per
+// line, e.g. updates saved from a tdbot connection. Every string of the
+// corpus is escaped as is and becomes the text of one updateNewMessage.
+
+#include "clijson.hpp"
+
+#include "auto/td/telegram/td_api.h"
+#include "auto/td/telegram/td_api_json.h"
+#include "auto/td_api_lua.h"
+
+#include "td/tl/TlObject.h"
+#include "td/utils/JsonBuilder.h"
+#include "td/utils/Time.h"
+#include "td/utils/misc.h"
+
+#include <lua.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+static void collect_strings (const td::JsonValue &value, std::vector<std::string> &out) {
+  switch (value.type ()) {
+    case td::JsonValue::Type::String:
+      out.push_back (value.get_string ().str ());
+      break;
+    case td::JsonValue::Type::Array:
+      for (auto &v : value.get_array ()) {
+        collect_strings (v, out);
+      }
+      break;
+    case td::JsonValue::Type::Object:
+      for (auto &f : value.get_object ()) {
+        collect_strings (f.second, out);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// the path to_lua replaced: encode, parse, then build the table from the
+// DOM; td's parser stands in for the nlohmann one the old code used
+static void push_json_value (lua_State *L, const td::JsonValue &value) {
+  switch (value.type ()) {
+    case td::JsonValue::Type::Boolean:
+      lua_pushboolean (L, value.get_boolean ());
+      break;
+    case td::JsonValue::Type::Number:
+      lua_pushnumber (L, td::to_double (value.get_number ()));
+      break;
+    case td::JsonValue::Type::String: {
+      auto s = value.get_string ();
+      lua_pushlstring (L, s.data (), s.size ());
+      break;
+    }
+    case td::JsonValue::Type::Array: {
+      auto &array = value.get_array ();
+      lua_createtable (L, static_cast<int>(array.size ()), 0);
+      int p = 0;
+      for (auto &v : array) {
+        lua_pushnumber (L, p++);
+        push_json_value (L, v);
+        lua_settable (L, -3);
+      }
+      break;
+    }
+    case td::JsonValue::Type::Object: {
+      auto &object = value.get_object ();
+      lua_createtable (L, 0, static_cast<int>(object.size ()));
+      for (auto &f : object) {
+        lua_pushlstring (L, f.first.data (), f.first.size ());
+        push_json_value (L, f.second);
+        lua_settable (L, -3);
+      }
+      break;
+    }
+    default:
+      lua_pushnil (L);
+  }
+}
+
+static std::shared_ptr<const td::td_api::Object> make_update (const std::string &text, td::int64 id) {
+  auto formatted = td::make_tl_object<td::td_api::formattedText>();
+  formatted->text_ = text;
+  auto content = td::make_tl_object<td::td_api::messageText>();
+  content->text_ = std::move (formatted);
+  auto message = td::make_tl_object<td::td_api::message>();
+  message->id_ = id;
+  message->chat_id_ = -1001000000000 - id % 1000;
+  message->date_ = 1500000000;
+  message->content_ = std::move (content);
+  auto update = td::make_tl_object<td::td_api::updateNewMessage>();
+  update->message_ = std::move (message);
+  return std::shared_ptr<const td::td_api::Object> (update.release ());
+}
+
+static void report (const char *name, double seconds, size_t items, size_t bytes) {
+  std::printf ("%-22s %9.3f ms %10.1f ns/item %9.1f MB/s\n", name, seconds * 1e3, seconds * 1e9 / static_cast<double>(items),
+               static_cast<double>(bytes) / seconds / 1e6);
+}
+
+static void bench_kernel (const char *name, JsonStringKernel kernel, const std::vector<std::string> &strings, size_t bytes, int rounds) {
+  if (!set_json_string_kernel (kernel)) {
+    std::printf ("%-22s not available\n", name);
+    return;
+  }
+  std::string out;
+  auto start = td::Time::now ();
+  for (int r = 0; r < rounds; r++) {
+    for (auto &s : strings) {
+      out.clear ();
+      append_json_string (out, s);
+    }
+  }
+  report (name, td::Time::now () - start, strings.size () * rounds, bytes * rounds);
+}
+
+// reads message.content.text.text, as a script looking at the text would
+static void read_text (lua_State *L) {
+  for (auto key : {"message", "content", "text", "text"}) {
+    lua_getfield (L, -1, key);
+    lua_remove (L, -2);
+  }
+  lua_pop (L, 1);
+}
+
+template <class F>
+static void bench_lua (const char *name, lua_State *L, const std::vector<std::shared_ptr<const td::td_api::Object>> &updates,
+                       size_t bytes, int rounds, F push) {
+  lua_gc (L, LUA_GCCOLLECT, 0);
+  auto start = td::Time::now ();
+  for (int r = 0; r < rounds; r++) {
+    for (auto &update : updates) {
+      push (update);
+      read_text (L);
+    }
+  }
+  report (name, td::Time::now () - start, updates.size () * rounds, bytes * rounds);
+}
+
+int main (int argc, char *argv[]) {
+  if (argc < 2) {
+    std::fprintf (stderr, "usage: %s <corpus> [rounds]\n", argv[0]);
+    return 1;
+  }
+  int rounds = argc > 2 ? std::atoi (argv[2]) : 20;
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  std::ifstream in (argv[1]);
+  if (!in) {
+    std::fprintf (stderr, "can not open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<std::string> strings;
+  std::string line;
+  while (std::getline (in, line)) {
+    auto r = td::json_decode (line);
+    if (r.is_ok ()) {
+      collect_strings (r.ok (), strings);
+    }
+  }
+  if (strings.empty ()) {
+    std::fprintf (stderr, "no strings in %s\n", argv[1]);
+    return 1;
+  }
+  size_t bytes = 0;
+  for (auto &s : strings) {
+    bytes += s.size ();
+  }
+  std::printf ("%zu strings, %zu bytes, %d rounds\n", strings.size (), bytes, rounds);
+
+  bench_kernel ("escape scalar", JsonStringKernel::Scalar, strings, bytes, rounds);
+  bench_kernel ("escape sse2", JsonStringKernel::Sse2, strings, bytes, rounds);
+  bench_kernel ("escape avx2", JsonStringKernel::Avx2, strings, bytes, rounds);
+  set_json_string_kernel (JsonStringKernel::Auto);
+
+  std::vector<std::shared_ptr<const td::td_api::Object>> updates;
+  for (auto &s : strings) {
+    updates.push_back (make_update (s, static_cast<td::int64>(updates.size ()) + 1));
+  }
+  auto L = luaL_newstate ();
+  luaL_openlibs (L);
+  bench_lua ("lua json+parse", L, updates, bytes, rounds, [&](const std::shared_ptr<const td::td_api::Object> &update) {
+    auto json = td::json_encode<std::string>(td::ToJson (*update));
+    auto r = td::json_decode (json);
+    push_json_value (L, r.ok ());
+  });
+  bench_lua ("lua to_lua", L, updates, bytes, rounds, [&](const std::shared_ptr<const td::td_api::Object> &update) {
+    td::to_lua (L, *update);
+  });
+  bench_lua ("lua proxy", L, updates, bytes, rounds, [&](const std::shared_ptr<const td::td_api::Object> &update) {
+    td::push_lua_proxy (L, update, *update);
+  });
+  lua_close (L);
+  return 0;
+}
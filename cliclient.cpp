@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstddef>
 #include <string>
 #include <vector>
@@ -21,6 +22,8 @@
 
 #include "td/utils/port/StdStreams.h"
 #include "td/utils/Slice.h"
+#include "td/utils/misc.h"
+#include "td/utils/Time.h"
 
 void set_stdin_echo (bool enable) {
 #ifdef WIN32
@@ -51,6 +54,113 @@ void set_stdin_echo (bool enable) {
 
 CliClient *CliClient::instance_ = nullptr;
 
+template <class T>
+static auto get_chat_id (const T &update, int) -> decltype (static_cast<td::int64>(update.chat_id_)) {
+  return update.chat_id_;
+}
+
+template <class T>
+static td::int64 get_chat_id (const T &update, long) {
+  return 0;
+}
+
+static td::int64 get_chat_id (const td::td_api::updateNewMessage &update, int) {
+  return update.message_ ? update.message_->chat_id_ : 0;
+}
+
+static td::int64 get_chat_id (const td::td_api::updateMessageSendSucceeded &update, int) {
+  return update.message_ ? update.message_->chat_id_ : 0;
+}
+
+static td::int64 get_chat_id (const td::td_api::updateMessageSendFailed &update, int) {
+  return update.message_ ? update.message_->chat_id_ : 0;
+}
+
+static td::int64 get_update_chat_id (td::td_api::Update &update) {
+  td::int64 chat_id = 0;
+  downcast_call (update, [&](auto &object) { chat_id = get_chat_id (object, 0); });
+  return chat_id;
+}
+
+static td::int64 get_delta_key (const td::td_api::Update &update) {
+  switch (update.get_id ()) {
+    case td::td_api::updateUser::ID: {
+      auto &u = static_cast<const td::td_api::updateUser &>(update);
+      return u.user_ ? u.user_->id_ : 0;
+    }
+    case td::td_api::updateUserFullInfo::ID:
+      return static_cast<const td::td_api::updateUserFullInfo &>(update).user_id_;
+    case td::td_api::updateNewChat::ID: {
+      auto &u = static_cast<const td::td_api::updateNewChat &>(update);
+      return u.chat_ ? u.chat_->id_ : 0;
+    }
+    case td::td_api::updateChatLastMessage::ID:
+      return static_cast<const td::td_api::updateChatLastMessage &>(update).chat_id_;
+    case td::td_api::updateBasicGroup::ID: {
+      auto &u = static_cast<const td::td_api::updateBasicGroup &>(update);
+      return u.basic_group_ ? u.basic_group_->id_ : 0;
+    }
+    case td::td_api::updateBasicGroupFullInfo::ID:
+      return static_cast<const td::td_api::updateBasicGroupFullInfo &>(update).basic_group_id_;
+    case td::td_api::updateSupergroup::ID: {
+      auto &u = static_cast<const td::td_api::updateSupergroup &>(update);
+      return u.supergroup_ ? u.supergroup_->id_ : 0;
+    }
+    case td::td_api::updateSupergroupFullInfo::ID:
+      return static_cast<const td::td_api::updateSupergroupFullInfo &>(update).supergroup_id_;
+    default:
+      return 0;
+  }
+}
+
+static td::JsonValue *get_json_field (td::JsonValue &value, td::Slice name) {
+  if (value.type () != td::JsonValue::Type::Object) {
+    return nullptr;
+  }
+  for (auto &field : value.get_object ()) {
+    if (field.first == name) {
+      return &field.second;
+    }
+  }
+  return nullptr;
+}
+
+static JsonProjection get_json_projection (td::JsonValue *value) {
+  JsonProjection projection;
+  if (value && value->type () == td::JsonValue::Type::Array) {
+    for (auto &path : value->get_array ()) {
+      if (path.type () == td::JsonValue::Type::String) {
+        projection.add_path (path.get_string ());
+      }
+    }
+  }
+  return projection;
+}
+
+static td::int64 get_json_int64 (td::JsonValue &value) {
+  if (value.type () == td::JsonValue::Type::Number) {
+    return td::to_integer<td::int64>(value.get_number ());
+  }
+  if (value.type () == td::JsonValue::Type::String) {
+    return td::to_integer<td::int64>(value.get_string ());
+  }
+  return 0;
+}
+
+// @type and chat_id of an encoded update, found without decoding it; the
+// chat of message updates is in message.chat_id
+static td::Slice sniff_update (td::Slice update, td::int64 &chat_id) {
+  static const td::Slice keys[] = {"@type", "chat_id", "message"};
+  td::Slice values[3];
+  sniff_json_fields (update, keys, 3, values);
+  auto chat = values[1];
+  if (chat.empty () && !values[2].empty ()) {
+    sniff_json_fields (values[2], keys + 1, 1, &chat);
+  }
+  chat_id = chat.empty () ? 0 : td::to_integer<td::int64>(chat);
+  return values[0];
+}
+
 CliSockFd::CliSockFd(td::SocketFd fd, CliClient *cli) : fd_ (std::move (fd)), cli_ (cli) {
   fd_.get_native_fd ().set_is_blocking (false).ensure ();
   td::Scheduler::subscribe(fd_.get_poll_info ().extract_pollable_fd (cli_), td::PollFlags::ReadWrite() | td::PollFlags::Close() | td::PollFlags::Error());
@@ -72,6 +182,190 @@ CliStdFd::~CliStdFd() {
   td::Scheduler::unsubscribe(td::Stdout ().get_poll_info ().get_pollable_fd_ref ());
 }
 
+void ConsumerGroup::add (td::uint64 member) {
+  for (auto m : members_) {
+    if (m == member) {
+      return;
+    }
+  }
+  members_.push_back (member);
+  load_[member] = 0;
+}
+
+void ConsumerGroup::remove (td::uint64 member) {
+  for (size_t i = 0; i < members_.size (); i++) {
+    if (members_[i] == member) {
+      members_.erase (members_.begin () + i);
+      break;
+    }
+  }
+  load_.erase (member);
+  for (auto it = owners_.begin (); it != owners_.end ();) {
+    if (it->second == member) {
+      it = owners_.erase (it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+td::uint64 ConsumerGroup::pick (td::int64 chat_id, const std::function<bool (td::uint64)> &accepts) {
+  if (chat_id == 0) {
+    for (size_t i = 0; i < members_.size (); i++) {
+      auto m = members_[next_++ % members_.size ()];
+      if (accepts (m)) {
+        return m;
+      }
+    }
+    return 0;
+  }
+  auto it = owners_.find (chat_id);
+  if (it != owners_.end () && accepts (it->second)) {
+    return it->second;
+  }
+  td::uint64 best = 0;
+  for (auto m : members_) {
+    if (accepts (m) && (best == 0 || load_[m] < load_[best])) {
+      best = m;
+    }
+  }
+  if (best != 0 && it == owners_.end ()) {
+    load_[best]++;
+    owners_[chat_id] = best;
+  }
+  return best;
+}
+
+bool CliFd::write_update (std::string str, std::string delta_key) {
+  if (!credit_mode_ || credits_ > 0) {
+    if (credit_mode_) {
+      credits_--;
+    }
+    write (std::move (str));
+    return true;
+  }
+  bool dropped = false;
+  if (held_.size () >= max_held_) {
+    drop_held ();
+    dropped = true;
+  }
+  held_.push_back (HeldUpdate{std::move (str), std::move (delta_key)});
+  return !dropped;
+}
+
+// drops the oldest held update; later held deltas of the same object build
+// on it, so they go too, and the object is sent in full the next time
+void CliFd::drop_held () {
+  auto key = std::move (held_.front ().delta_key);
+  held_.pop_front ();
+  if (!key.empty ()) {
+    delta_state_.erase (key);
+    held_.erase (std::remove_if (held_.begin (), held_.end (), [&](const HeldUpdate &held) { return held.delta_key == key; }), held_.end ());
+  }
+}
+
+void CliFd::grant_credits (td::int64 credits, size_t max_held) {
+  if (credits < 0) {
+    credit_mode_ = false;
+    credits_ = 0;
+  } else {
+    credit_mode_ = true;
+    credits_ += credits;
+    if (max_held > 0) {
+      max_held_ = max_held;
+    }
+    while (held_.size () > max_held_) {
+      drop_held ();
+    }
+  }
+  while (!held_.empty () && (!credit_mode_ || credits_ > 0)) {
+    if (credit_mode_) {
+      credits_--;
+    }
+    write (std::move (held_.front ().str));
+    held_.pop_front ();
+  }
+}
+
+bool CliFd::make_delta (const std::string &type, td::int64 key, std::string &json) {
+  auto &state = delta_state_[get_delta_state_key (type, key)];
+  if (state.empty ()) {
+    state = json;
+    return true;
+  }
+
+  std::string old_buf = state;
+  std::string new_buf = json;
+  auto old_value = td::json_decode (old_buf);
+  auto new_value = td::json_decode (new_buf);
+  if (old_value.is_error () || new_value.is_error ()) {
+    state = json;
+    return true;
+  }
+
+  std::string patch;
+  if (!append_json_merge_patch (patch, old_value.ok (), new_value.ok ())) {
+    return false;
+  }
+  state = std::move (json);
+
+  json = "{\"@type\":\"tdbotUpdateDelta\",\"update_type\":";
+  append_json_string (json, type);
+  json += ",\"key\":\"" + std::to_string (key) + "\",\"patch\":";
+  json += patch;
+  json += '}';
+  return true;
+}
+
+static int get_command_priority (td::Slice cmd) {
+  static const td::Slice keys[] = {"@priority"};
+  td::Slice value;
+  sniff_json_fields (cmd, keys, 1, &value);
+  return !value.empty () && value[0] >= '1' && value[0] <= '9' ? 1 : 0;
+}
+
+bool CliFd::split_commands (std::string &in) {
+  auto end = in.rfind ('\n');
+  if (end == std::string::npos) {
+    return false;
+  }
+
+  // hand the complete lines over without copying them; only the trailing
+  // partial line, if any, is copied back into the input buffer
+  std::string rest = in.substr (end + 1);
+  in.resize (end + 1);
+  auto block = std::make_shared<std::string> (std::move (in));
+  in = std::move (rest);
+
+  td::MutableSlice data (&(*block)[0], block->size ());
+  size_t begin = 0;
+  bool found = false;
+  while (begin < data.size ()) {
+    auto p = static_cast<size_t>(std::find (data.begin () + begin, data.end (), '\n') - data.begin ());
+    if (p > begin) {
+      Command cmd{block, data.substr (begin, p - begin)};
+      if (get_command_priority (cmd.text) > 0) {
+        high_commands_.push_back (std::move (cmd));
+      } else {
+        commands_.push_back (std::move (cmd));
+      }
+      found = true;
+    }
+    begin = p + 1;
+  }
+  return found;
+}
+
+bool CliFd::pop_command (Command &cmd) {
+  auto &queue = high_commands_.empty () ? commands_ : high_commands_;
+  if (queue.empty ()) {
+    return false;
+  }
+  cmd = std::move (queue.front ());
+  queue.pop_front ();
+  return true;
+}
+
 void CliFd::work (td::uint64 id) {
   sock_sync ();
   sock_read (id);
@@ -95,22 +389,12 @@ void CliSockFd::sock_read (td::uint64 id) {
     auto res = fd_.read (s);
 
     if (res.is_ok ()) {
-      in_ += s.substr (0, res.ok ()).str ();
+      in_.append (s.data (), res.ok ());
     }
   }
   
-  if (in_.length () > 0) {
-    while (1) {
-      auto p = in_.find ('\n');
-      if (p >= in_.length ()) {
-        break;
-      }
-      auto s = in_.substr (0, p);
-      if (s.length () > 0) {
-        cli_->run (id, s);
-      }
-      in_.erase (0, p + 1);
-    }
+  if (split_commands (in_)) {
+    cli_->schedule_loop ();
   }
 }
 
@@ -121,22 +405,12 @@ void CliStdFd::sock_read (td::uint64 id) {
     auto res = td::Stdin().read (s);
 
     if (res.is_ok ()) {
-      in_ += s.substr (0, res.ok ()).str ();
+      in_.append (s.data (), res.ok ());
     }
   }
   
-  if (in_.length () > 0) {
-    while (1) {
-      auto p = in_.find ('\n');
-      if (p >= in_.length ()) {
-        break;
-      }
-      auto s = in_.substr (0, p);
-      in_.erase (0, p + 1);
-      if (s.length () > 0) {
-        cli_->run (id, s);
-      }
-    }
+  if (split_commands (in_)) {
+    cli_->schedule_loop ();
   }
 }
 
@@ -286,6 +560,45 @@ void CliClient::authentificate_continue (td::td_api::AuthorizationState &result)
   downcast_call (result, [&](auto &object){this->login_continue (object);});
 }
 
+#if TDBOT_FAST_JSON
+// drops cached JSON of the objects an update changes; every update about a
+// chat may change some field of its chat object
+static void invalidate_fragments (JsonFragmentCache &cache, const td::td_api::Update &update, td::int64 chat_id) {
+  using Kind = JsonFragmentCache::Kind;
+  switch (update.get_id ()) {
+    case td::td_api::updateUser::ID: {
+      auto &user = static_cast<const td::td_api::updateUser &>(update).user_;
+      if (user) {
+        cache.invalidate (Kind::User, user->id_);
+      }
+      break;
+    }
+    case td::td_api::updateUserStatus::ID:
+      cache.invalidate (Kind::User, static_cast<const td::td_api::updateUserStatus &>(update).user_id_);
+      break;
+    case td::td_api::updateNewChat::ID: {
+      auto &chat = static_cast<const td::td_api::updateNewChat &>(update).chat_;
+      if (chat) {
+        cache.invalidate (Kind::Chat, chat->id_);
+      }
+      break;
+    }
+    case td::td_api::updateFile::ID: {
+      auto &file = static_cast<const td::td_api::updateFile &>(update).file_;
+      if (file) {
+        cache.invalidate (Kind::File, file->id_);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  if (chat_id != 0) {
+    cache.invalidate (Kind::Chat, chat_id);
+  }
+}
+#endif
+
 void CliClient::on_update (td::tl_object_ptr<td::td_api::Update> update) {
   if (update->get_id () == td::td_api::updateAuthorizationState::ID) {
     auto t = td::move_tl_object_as<td::td_api::updateAuthorizationState>(update);
@@ -293,18 +606,659 @@ void CliClient::on_update (td::tl_object_ptr<td::td_api::Update> update) {
     update = td::move_tl_object_as<td::td_api::Update>(t);
 
   }
+  const std::string &type = get_update_type (*update);
+  auto chat_id = get_update_chat_id (*update);
+  auto delta_key = get_delta_key (*update);
+#if TDBOT_FAST_JSON
+  invalidate_fragments (fragment_cache_, *update, chat_id);
+#endif
+
   auto object = td::td_api::move_object_as<td::td_api::Object>(update);
-  std::string v = td::json_encode<std::string>(td::ToJson (object));
+  stats_.updates_received++;
+  auto seq = ++update_seq_;
+  auto seq_str = std::to_string (seq);
+
+  std::string v;
+  bool encoded = false;
+  auto get_json = [&]() -> const std::string & {
+    if (!encoded) {
+      v = encoder_.encode (object->get_id (), object);
+      encoded = true;
+      stats_.updates_encoded++;
+    }
+    return v;
+  };
+
+#if !TDBOT_FAST_JSON
+  // ToJson can not skip fields, so projections are cut from a DOM decoded
+  // once per update
+  std::string dom_buf;
+  td::JsonValue dom;
+  bool decoded = false;
+  auto get_dom = [&]() -> const td::JsonValue * {
+    if (!decoded) {
+      decoded = true;
+      auto &json = get_json ();
+      dom_buf = encoder_.acquire (json.size ());
+      std::copy (json.begin (), json.end (), dom_buf.begin ());
+      auto r = td::json_decode (dom_buf);
+      if (r.is_error ()) {
+        LOG(ERROR) << "can not decode update for projection: " << r.error ();
+      } else {
+        dom = r.move_as_ok ();
+      }
+    }
+    return dom.type () == td::JsonValue::Type::Null ? nullptr : &dom;
+  };
+#endif
+
+  std::map<std::string, td::uint64> group_members;
+  for (auto &g : groups_) {
+    auto member = g.second.pick (chat_id, [&](td::uint64 id) {
+      auto T = fds_.get (id);
+      return T != nullptr && T->get ()->filter ().match (type, chat_id);
+    });
+    if (member == 0) {
+      stats_.updates_filtered++;
+    }
+    group_members[g.first] = member;
+  }
 
   fds_.for_each ([&](td::uint64 id, auto &x) {  
-    x.get()->write (v);
+    if (!x.get()->group ().empty ()) {
+      if (group_members[x.get()->group ()] != id) {
+        return;
+      }
+    } else if (!x.get()->filter ().match (type, chat_id)) {
+      stats_.updates_filtered++;
+      return;
+    }
+    auto projection = x.get()->get_projection (type);
+    std::string p;
+#if TDBOT_FAST_JSON
+    if (projection) {
+      p = encoder_.encode (object->get_id (), object, *projection);
+    } else {
+      p = get_json ();
+    }
+#else
+    const td::JsonValue *d;
+    if (projection && (d = get_dom ()) != nullptr) {
+      projection->store (p, *d);
+    } else {
+      p = get_json ();
+    }
+#endif
+    std::string delta_state_key;
+    if (delta_key != 0 && x.get()->delta_mode ()) {
+      if (!x.get()->make_delta (type, delta_key, p)) {
+        stats_.updates_unchanged++;
+        return;
+      }
+      delta_state_key = CliFd::get_delta_state_key (type, delta_key);
+    }
+    add_json_field (p, "@seq", seq_str);
+    if (!x.get()->write_update (std::move (p), std::move (delta_state_key))) {
+      stats_.updates_dropped++;
+    }
     x.get()->work (id);
     });
 
-  if (clua_) {
-    clua_->update (v); 
+  if (replay_ || journal_) {
+    std::string r = get_json ();
+    add_json_field (r, "@seq", seq_str);
+    if (replay_) {
+      replay_->append (seq, r);
+    }
+    if (journal_) {
+      journal_->append (seq, r);
+      schedule_loop ();
+    }
+  }
+
+  if (encoded) {
+    encoder_.release (std::move (v));
+  } else {
+    stats_.updates_encode_skipped++;
+  }
+#if !TDBOT_FAST_JSON
+  if (decoded) {
+    dom = td::JsonValue ();
+    encoder_.release (std::move (dom_buf));
+  }
+#endif
+
+  // last, as a lazy script keeps the object
+  if (!lua_workers_.empty ()) {
+    auto worker = static_cast<td::uint64>(chat_id) % lua_workers_.size ();
+    td::send_closure (lua_workers_[worker], &LuaWorker::update, std::move (object));
+  }
+}
+
+void CliClient::send_lua_request (int worker, int generation, td::tl_object_ptr<td::td_api::Function> function, int a1, int a2) {
+  send_request (std::move (function), std::make_unique<TdLuaCallback>(generation, a1, a2, lua_workers_[worker].get ()));
+}
+
+void CliClient::reload_script () {
+  for (auto &worker : lua_workers_) {
+    td::send_closure (worker, &LuaWorker::reload);
+  }
+}
+const std::string &CliClient::get_update_type (const td::td_api::Update &update) {
+  auto it = update_type_names_.find (update.get_id ());
+  if (it != update_type_names_.end ()) {
+    return it->second;
+  }
+  // td_api has no name table, so take the class name from the first to_string of each type
+  auto s = td::td_api::to_string (update);
+  auto p = s.find (' ');
+  return update_type_names_[update.get_id ()] = s.substr (0, p);
+}
+
+void CliClient::write_error (td::uint64 id, td::int32 code, std::string message, const std::string &extra) {
+  auto T = fds_.get (id);
+  if (!T) {
+    return;
   }
+  std::string er = std::string ("") +  "{\"_\":\"error\",\"code\":" + std::to_string (code) + ",\"message\":";
+  append_json_string (er, message);
+  er += '}';
+  add_json_extra (er, extra);
+  T->get ()->write (er);
 }
+
+void CliClient::write_ok (td::uint64 id, const std::string &extra) {
+  auto T = fds_.get (id);
+  if (!T) {
+    return;
+  }
+  std::string ok = "{\"@type\":\"ok\"}";
+  add_json_extra (ok, extra);
+  T->get ()->write (ok);
+}
+
+void CliClient::run (td::uint64 id, td::MutableSlice cmd) {
+  size_t begin = 0;
+  size_t end = cmd.size ();
+  while (begin < end && isspace (static_cast<unsigned char>(cmd[begin]))) {
+    begin++;
+  }
+  while (end > begin && isspace (static_cast<unsigned char>(cmd[end - 1]))) {
+    end--;
+  }
+  // decoded in place: strings in the JsonValue point into the input block
+  auto res = td::json_decode (cmd.substr (begin, end - begin));
+
+  if (res.is_error ()) {
+    auto R = res.move_as_error ();
+    write_error (id, R.code (), R.public_message ());
+    return;
+  }
+
+  auto value = res.move_as_ok ();
+  if (run_local (id, value)) {
+    return;
+  }
+  auto fields = get_json_projection (get_json_field (value, "@fields"));
+
+  std::string extra;
+  auto extra_value = get_json_field (value, "@extra");
+  if (extra_value) {
+    append_json_value (extra, *extra_value);
+  }
+  // @extra is the key for tdbotCancel, so it must identify one request
+  if (!extra.empty ()) {
+    auto T = fds_.get (id);
+    if (T && T->get ()->pending ().count (extra) != 0) {
+      write_error (id, 400, "a request with this @extra is already pending", extra);
+      return;
+    }
+  }
+
+  size_t chunk_size = 0;
+  auto chunk_size_value = get_json_field (value, "@chunk_size");
+  if (chunk_size_value) {
+    auto c = get_json_int64 (*chunk_size_value);
+    chunk_size = c > 0 ? static_cast<size_t>(c) : 0;
+  }
+
+  double timeout = 0;
+  auto timeout_value = get_json_field (value, "@timeout");
+  if (timeout_value && timeout_value->type () == td::JsonValue::Type::Number) {
+    timeout = td::to_double (timeout_value->get_number ());
+  }
+
+  td::tl_object_ptr<td::td_api::Function> object;
+  auto r = from_json(object, std::move (value));
+
+  if (r.is_error ()) {
+    auto R = r.move_as_error ();
+    write_error (id, R.code (), R.public_message (), extra);
+    return;
+  }
+
+  td::tl_object_ptr<td::td_api::Function> cancel;
+  if (object->get_id () == td::td_api::downloadFile::ID) {
+    auto &download = static_cast<const td::td_api::downloadFile &>(*object);
+    cancel = td::make_tl_object<td::td_api::cancelDownloadFile>(download.file_id_, false);
+  }
+
+  auto callback = std::make_unique<TdCmdCallback>(id, this, std::move (fields), extra, chunk_size);
+  auto callback_ptr = callback.get ();
+  auto query_id = send_request(std::move (object), std::move (callback));
+  callback_ptr->set_query_id (query_id);
+
+  if (!extra.empty ()) {
+    auto T = fds_.get (id);
+    if (T) {
+      T->get ()->pending ()[extra] = PendingQuery{query_id, std::move (cancel)};
+    }
+  }
+  if (timeout > 0) {
+    set_deadline (query_id, timeout);
+  }
+}
+
+template <class T>
+size_t CliClient::TdCmdCallback::write_chunks (std::vector<T> &items, td::Slice field) {
+  if (items.size () <= chunk_size_) {
+    return 0;
+  }
+  const JsonProjection *projection = nullptr;
+  if (!fields_.empty ()) {
+    projection = fields_.get_child (field);
+    if (!projection) {
+      return 0;
+    }
+  }
+
+  size_t chunks = 0;
+  for (size_t i = 0; i < items.size (); i += chunk_size_) {
+    std::string v = "{\"@type\":\"tdbotChunk\",\"index\":" + std::to_string (chunks) + ",\"items\":[";
+    for (size_t j = i; j < items.size () && j < i + chunk_size_; j++) {
+      if (j != i) {
+        v += ',';
+      }
+      auto id = items[j]->get_id ();
+      auto item = projection ? cli_->encoder_.encode (id, items[j], *projection) : cli_->encoder_.encode (id, items[j]);
+      v += item;
+      cli_->encoder_.release (std::move (item));
+      items[j] = nullptr;
+    }
+    v += "]}";
+    add_json_extra (v, extra_);
+
+    auto T = cli_->fds_.get (id_);
+    if (!T) {
+      break;
+    }
+    T->get ()->write (std::move (v));
+    T->get ()->work (id_);
+    chunks++;
+  }
+  items.clear ();
+  return chunks;
+}
+
+void CliClient::TdCmdCallback::on_result (td::tl_object_ptr<td::td_api::Object> result) {
+  auto T = cli_->fds_.get (id_);
+  if (!T) {
+    return;
+  }
+  if (!extra_.empty ()) {
+    auto &pending = T->get ()->pending ();
+    auto it = pending.find (extra_);
+    if (it != pending.end () && it->second.query_id == query_id_) {
+      pending.erase (it);
+    }
+  }
+
+  size_t chunks = 0;
+  if (chunk_size_ > 0) {
+    switch (result->get_id ()) {
+      case td::td_api::messages::ID:
+        chunks = write_chunks (static_cast<td::td_api::messages &>(*result).messages_, "messages");
+        break;
+      case td::td_api::chatMembers::ID:
+        chunks = write_chunks (static_cast<td::td_api::chatMembers &>(*result).members_, "members");
+        break;
+      default:
+        break;
+    }
+  }
+
+  T = cli_->fds_.get (id_);
+  if (!T) {
+    return;
+  }
+  auto id = result->get_id ();
+  auto v = fields_.empty () ? cli_->encoder_.encode (id, result) : cli_->encoder_.encode (id, result, fields_);
+  if (chunks > 0) {
+    v = "{\"@type\":\"tdbotChunkEnd\",\"chunks\":" + std::to_string (chunks) + ",\"result\":" + v + "}";
+  }
+  add_json_extra (v, extra_);
+  T->get ()->write (std::move (v));
+  T->get ()->work (id_);
+}
+
+bool CliClient::cancel_query (PendingQuery query) {
+  if (handlers_.get (query.query_id) == nullptr) {
+    return false;
+  }
+  handlers_.erase (query.query_id);
+  stats_.requests_cancelled++;
+  if (query.cancel) {
+    send_request (std::move (query.cancel), std::make_unique<TdDropCallback>());
+  }
+  return true;
+}
+
+void CliClient::replay_updates (td::uint64 id, td::uint64 seq, const std::string &extra, bool from_journal) {
+  auto T = fds_.get (id);
+  if (!T) {
+    return;
+  }
+  auto fd = T->get ();
+  size_t count = 0;
+  auto deliver = [&](td::uint64 update_seq, td::Slice update) {
+    td::int64 chat_id;
+    auto type = sniff_update (update, chat_id).str ();
+    if (type.empty () || !fd->filter ().match (type, chat_id)) {
+      return;
+    }
+    // only projected updates need a DOM
+    auto projection = fd->get_projection (type);
+    std::string p;
+    if (projection) {
+      std::string buf = update.str ();
+      auto r = td::json_decode (buf);
+      if (r.is_error ()) {
+        return;
+      }
+      projection->store (p, r.ok ());
+    } else {
+      p = update.str ();
+    }
+    if (!fd->write_update (std::move (p))) {
+      stats_.updates_dropped++;
+    }
+    count++;
+  };
+
+  bool complete = true;
+  if (from_journal) {
+    journal_->replay (seq, deliver);
+  } else {
+    complete = replay_->replay (seq, deliver);
+  }
+
+  std::string v = "{\"@type\":\"tdbotResumed\",\"from_seq\":" + std::to_string (seq) + ",\"last_seq\":" + std::to_string (update_seq_) + ",\"count\":" + std::to_string (count) + ",\"complete\":" + (complete ? "true" : "false") + "}";
+  add_json_extra (v, extra);
+  fd->write (v);
+}
+
+void CliClient::leave_group (td::uint64 id) {
+  auto T = fds_.get (id);
+  if (!T || T->get ()->group ().empty ()) {
+    return;
+  }
+  auto it = groups_.find (T->get ()->group ());
+  if (it != groups_.end ()) {
+    it->second.remove (id);
+    if (it->second.empty ()) {
+      groups_.erase (it);
+    }
+  }
+  T->get ()->group ().clear ();
+}
+
+void CliClient::del_fd (td::uint64 id) {
+  leave_group (id);
+  auto T = fds_.get (id);
+  if (T) {
+    for (auto &it : T->get ()->pending ()) {
+      cancel_query (std::move (it.second));
+    }
+  }
+  fds_.erase (id);
+}
+
+void CliClient::set_deadline (td::uint64 id, double timeout) {
+  auto now = td::Time::now ();
+  deadlines_.add (now, now + timeout, id);
+  if (!has_timeout ()) {
+    set_timeout_in (deadlines_.tick ());
+  }
+}
+
+void CliClient::timeout_expired () {
+  std::vector<td::uint64> expired;
+  deadlines_.advance (td::Time::now (), expired);
+
+  for (auto id : expired) {
+    auto *handler_ptr = handlers_.get (id);
+    if (handler_ptr == nullptr) {
+      continue;
+    }
+    auto handler = std::move (*handler_ptr);
+    handlers_.erase (id);
+    stats_.requests_timed_out++;
+    handler->on_error (td::make_tl_object<td::td_api::error>(408, "Request timed out"));
+  }
+
+  if (!deadlines_.empty ()) {
+    set_timeout_in (deadlines_.tick ());
+  }
+}
+
+bool CliClient::run_local (td::uint64 id, td::JsonValue &cmd) {
+  auto type = get_json_field (cmd, "@type");
+  if (!type || type->type () != td::JsonValue::Type::String || !td::begins_with (type->get_string (), "tdbot")) {
+    return false;
+  }
+  auto T = fds_.get (id);
+  std::string extra;
+  auto extra_value = get_json_field (cmd, "@extra");
+  if (extra_value) {
+    append_json_value (extra, *extra_value);
+  }
+
+  if (type->get_string () == "tdbotSubscribe") {
+    if (!T) {
+      return true;
+    }
+    auto &filter = T->get ()->filter ();
+    filter.types_.clear ();
+    filter.chat_ids_.clear ();
+
+    auto types = get_json_field (cmd, "update_types");
+    if (types && types->type () == td::JsonValue::Type::Array) {
+      for (auto &t : types->get_array ()) {
+        if (t.type () == td::JsonValue::Type::String) {
+          filter.types_.insert (t.get_string ().str ());
+        }
+      }
+    }
+    auto chat_ids = get_json_field (cmd, "chat_ids");
+    if (chat_ids && chat_ids->type () == td::JsonValue::Type::Array) {
+      for (auto &c : chat_ids->get_array ()) {
+        auto chat_id = get_json_int64 (c);
+        if (chat_id != 0) {
+          filter.chat_ids_.insert (chat_id);
+        }
+      }
+    }
+    write_ok (id, extra);
+    return true;
+  }
+
+  if (type->get_string () == "tdbotSetProjection") {
+    auto update_type = get_json_field (cmd, "update_type");
+    if (!update_type || update_type->type () != td::JsonValue::Type::String) {
+      write_error (id, 400, "update_type must be a string", extra);
+      return true;
+    }
+    if (T) {
+      T->get ()->set_projection (update_type->get_string ().str (), get_json_projection (get_json_field (cmd, "fields")));
+      write_ok (id, extra);
+    }
+    return true;
+  }
+
+  if (type->get_string () == "tdbotCancel") {
+    auto target = get_json_field (cmd, "extra");
+    if (!target) {
+      write_error (id, 400, "extra must be specified", extra);
+      return true;
+    }
+    std::string key;
+    append_json_value (key, *target);
+
+    bool cancelled = false;
+    if (T) {
+      auto &pending = T->get ()->pending ();
+      auto it = pending.find (key);
+      if (it != pending.end ()) {
+        auto query = std::move (it->second);
+        pending.erase (it);
+        cancelled = cancel_query (std::move (query));
+      }
+    }
+    if (!cancelled) {
+      write_error (id, 404, "Request not found", extra);
+      return true;
+    }
+    write_ok (id, extra);
+    return true;
+  }
+
+  // "enabled":false turns credit mode off and flushes held updates
+  if (type->get_string () == "tdbotGrantCredits") {
+    auto enabled = get_json_field (cmd, "enabled");
+    if (enabled && enabled->type () == td::JsonValue::Type::Boolean && !enabled->get_boolean ()) {
+      if (T) {
+        T->get ()->grant_credits (-1, 0);
+      }
+      write_ok (id, extra);
+      return true;
+    }
+    auto credits = get_json_field (cmd, "credits");
+    auto credits_count = credits ? get_json_int64 (*credits) : 0;
+    if (credits_count <= 0) {
+      write_error (id, 400, "credits must be a positive integer", extra);
+      return true;
+    }
+    td::int64 max_queued_count = 0;
+    auto max_queued = get_json_field (cmd, "max_queued");
+    if (max_queued) {
+      max_queued_count = get_json_int64 (*max_queued);
+      if (max_queued_count <= 0) {
+        write_error (id, 400, "max_queued must be a positive integer", extra);
+        return true;
+      }
+    }
+    if (T) {
+      T->get ()->grant_credits (credits_count, static_cast<size_t>(max_queued_count));
+    }
+    write_ok (id, extra);
+    return true;
+  }
+
+  if (type->get_string () == "tdbotSetDeltaMode") {
+    auto enabled = get_json_field (cmd, "enabled");
+    if (T) {
+      T->get ()->set_delta_mode (enabled && enabled->type () == td::JsonValue::Type::Boolean && enabled->get_boolean ());
+      write_ok (id, extra);
+    }
+    return true;
+  }
+
+  if (type->get_string () == "tdbotJoinGroup" || type->get_string () == "tdbotLeaveGroup") {
+    leave_group (id);
+    if (type->get_string () == "tdbotJoinGroup") {
+      auto group = get_json_field (cmd, "group");
+      if (!group || group->type () != td::JsonValue::Type::String || group->get_string ().empty ()) {
+        write_error (id, 400, "group must be a non-empty string", extra);
+        return true;
+      }
+      if (T) {
+        T->get ()->group () = group->get_string ().str ();
+        groups_[T->get ()->group ()].add (id);
+      }
+    }
+    write_ok (id, extra);
+    return true;
+  }
+
+  if (type->get_string () == "tdbotResume") {
+    auto from_seq = get_json_field (cmd, "from_seq");
+    if (!replay_) {
+      write_error (id, 400, "replay buffer is disabled", extra);
+      return true;
+    }
+    replay_updates (id, from_seq ? static_cast<td::uint64>(get_json_int64 (*from_seq)) : 0, extra, false);
+    return true;
+  }
+
+  if (type->get_string () == "tdbotJournalSubscribe") {
+    if (!journal_) {
+      write_error (id, 400, "journal is disabled", extra);
+      return true;
+    }
+    auto consumer = get_json_field (cmd, "consumer");
+    if (!consumer || consumer->type () != td::JsonValue::Type::String || !Journal::is_valid_consumer_name (consumer->get_string ())) {
+      write_error (id, 400, "consumer must be a non-empty string of [A-Za-z0-9_.-]", extra);
+      return true;
+    }
+    if (!T) {
+      return true;
+    }
+    T->get ()->journal_consumer () = consumer->get_string ().str ();
+    auto seq = journal_->add_consumer (T->get ()->journal_consumer ());
+    auto from_seq = get_json_field (cmd, "from_seq");
+    if (from_seq) {
+      seq = static_cast<td::uint64>(get_json_int64 (*from_seq));
+    }
+    schedule_loop ();
+    replay_updates (id, seq, extra, true);
+    return true;
+  }
+
+  if (type->get_string () == "tdbotJournalAck") {
+    auto seq = get_json_field (cmd, "seq");
+    if (!journal_ || !T || T->get ()->journal_consumer ().empty () || !seq) {
+      write_error (id, 400, "not subscribed to the journal", extra);
+      return true;
+    }
+    journal_->ack (T->get ()->journal_consumer (), static_cast<td::uint64>(get_json_int64 (*seq)));
+    schedule_loop ();
+    return true;
+  }
+
+  // workers load the script asynchronously, so ok only means the reload
+  // started; a script that fails to load is logged and the old one stays
+  if (type->get_string () == "tdbotReloadScript") {
+    if (lua_workers_.empty ()) {
+      write_error (id, 400, "no lua script is loaded", extra);
+      return true;
+    }
+    reload_script ();
+    write_ok (id, extra);
+    return true;
+  }
+
+  if (type->get_string () == "tdbotGetStats") {
+    if (T) {
+      auto stats = stats_.to_json (update_seq_, encoder_.check_stats ());
+      add_json_extra (stats, extra);
+      T->get ()->write (stats);
+    }
+    return true;
+  }
+
+  return false;
+}
+
 void CliClient::on_result (td::uint64 id, td::tl_object_ptr<td::td_api::Object> result) {
   if (id == 0) {
     on_update (td::move_tl_object_as<td::td_api::Update>(result));
@@ -312,20 +1266,27 @@ void CliClient::on_result (td::uint64 id, td::tl_object_ptr<td::td_api::Object>
   }   
 
   auto *handler_ptr = handlers_.get(id);
-  CHECK(handler_ptr != nullptr);
+  if (handler_ptr == nullptr) {
+    LOG(INFO) << "dropping result of expired query " << id;
+    return;
+  }
   auto handler = std::move(*handler_ptr);
   handler->on_result(std::move(result));
   handlers_.erase(id);
 }
 void CliClient::on_error (td::uint64 id, td::tl_object_ptr<td::td_api::error> error) {
   auto *handler_ptr = handlers_.get(id);
-  CHECK(handler_ptr != nullptr);
+  if (handler_ptr == nullptr) {
+    LOG(INFO) << "dropping error of expired query " << id;
+    return;
+  }
   auto handler = std::move(*handler_ptr);
   handler->on_error(std::move (error));
   handlers_.erase(id);
 }
 
 void CliClient::loop() {
+  loop_scheduled_ = false;
   if (!inited_) {
     inited_ = true;
     init();
@@ -349,6 +1310,13 @@ void CliClient::loop() {
   fds_.for_each ([&](td::uint64 id, auto &x) {  
     x.get()->work (id);
     });
+
+  dispatch_commands ();
+
+  // group commit: everything journaled since the previous pass is synced at once
+  if (journal_) {
+    journal_->commit ();
+  }
     
   if (ready_to_stop_) {
     td::Scheduler::instance()->finish();
@@ -356,6 +1324,52 @@ void CliClient::loop() {
   }
 }
 
+void CliClient::schedule_loop () {
+  if (!loop_scheduled_) {
+    loop_scheduled_ = true;
+    yield ();
+  }
+}
+
+void CliClient::dispatch_commands () {
+
+  // every connection gets at most commands_per_tick_ commands per pass, so a
+  // pipelining client can not starve the others or the update fan-out
+  std::vector<td::uint64> ids;
+  fds_.for_each ([&](td::uint64 id, auto &x) {
+    if (x.get()->has_commands ()) {
+      ids.push_back (id);
+    }
+    });
+
+  bool more = false;
+  CliFd::Command cmd;
+  for (auto id : ids) {
+    for (int i = 0; i < commands_per_tick_; i++) {
+      auto T = fds_.get (id);
+      if (!T || !T->get ()->pop_command (cmd)) {
+        break;
+      }
+      run (id, cmd.text);
+    }
+    auto T = fds_.get (id);
+    if (!T) {
+      continue;
+    }
+    // local replies are only queued by run, so flush them now; a quiet
+    // connection may not see another work () for a long time
+    T->get ()->work (id);
+    T = fds_.get (id);
+    if (T && T->get ()->has_commands ()) {
+      more = true;
+    }
+  }
+
+  if (more) {
+    schedule_loop ();
+  }
+}
+
 td::unique_ptr<td::TdCallback> CliClient::make_td_callback() {
   class TdCallbackImpl : public td::TdCallback {
     public:
@@ -379,6 +1393,12 @@ td::unique_ptr<td::TdCallback> CliClient::make_td_callback() {
 
 void CliClient::init() {
   instance_ = this;
+#if TDBOT_FAST_JSON
+  JsonFragmentCache::instance_ = &fragment_cache_;
+  if (check_json_ > 0) {
+    encoder_.set_check_every (static_cast<td::uint32>(check_json_));
+  }
+#endif
   init_td();
 
   if (!login_mode_) {
@@ -396,7 +1416,26 @@ void CliClient::init() {
     }
 
     if (lua_script_.length () > 0) {
-      clua_ = new CliLua (lua_script_);
+      // dedicated Lua schedulers are the last lua_threads_ ones, see main
+      auto count = lua_threads_ > 0 ? lua_threads_ : 1;
+      auto first_scheduler = td::Scheduler::instance ()->sched_count () - lua_threads_;
+      for (int i = 0; i < count; i++) {
+        auto scheduler = lua_threads_ > 0 ? first_scheduler + i : td::Scheduler::instance ()->sched_id ();
+        lua_workers_.push_back (td::create_actor_on_scheduler<LuaWorker>("LuaWorker", scheduler, lua_script_, actor_id (this), i));
+      }
+    }
+
+    if (replay_blocks_ > 0) {
+      replay_ = std::make_unique<ReplayRing>(static_cast<size_t>(replay_blocks_));
+    }
+
+    if (journal_dir_.length () > 0) {
+      journal_ = std::make_unique<Journal>(journal_dir_, journal_max_size_);
+      auto status = journal_->open ();
+      if (status.is_error ()) {
+        LOG(FATAL) << "can not open journal: " << status;
+      }
+      update_seq_ = journal_->last_seq ();
     }
   }
 
@@ -404,6 +1443,12 @@ void CliClient::init() {
 }
 
 void CliClient::tear_down() {
+#if TDBOT_FAST_JSON
+  JsonFragmentCache::instance_ = nullptr;
+#endif
+  if (journal_) {
+    journal_->commit ();
+  }
   if (!listen_.empty()) {
     td::Scheduler::unsubscribe(listen_.get_poll_info ().get_pollable_fd_ref ());
   }
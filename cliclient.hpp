@@ -1,9 +1,12 @@
 #pragma once
 
+#include <deque>
+#include <functional>
 #include <list>
 #include <set>
 #include <unordered_map>
 #include <map>
+#include <memory>
 #include <string>
 #include <sstream>
 
@@ -12,15 +15,26 @@
 #include "td/tl/TlObject.h"
 #include "td/utils/port/ServerSocketFd.h"
 #include "td/utils/Container.h"
+#include "td/utils/JsonBuilder.h"
 #include "td/telegram/TdParameters.h"
 
 #include "auto/td/telegram/td_api.h"
 #include "auto/td/telegram/td_api.hpp"
 
 #include "auto/td/telegram/td_api_json.h"
+#if TDBOT_FAST_JSON
+#include "auto/td_api_json_fast.h"
+#endif
+
+#include "clijson.hpp"
+#include "journal.hpp"
+#include "jsoncache.hpp"
+#include "replayring.hpp"
+#include "timerwheel.hpp"
 
 
 class CliLua;
+class LuaWorker;
 
 class TdQueryCallback {
   public:
@@ -32,24 +46,179 @@ class TdQueryCallback {
 
 class CliClient;
 
+class UpdateFilter {
+  public:
+    bool match (const std::string &type, td::int64 chat_id) const {
+      if (!types_.empty () && types_.count (type) == 0) {
+        return false;
+      }
+      if (chat_id != 0 && !chat_ids_.empty () && chat_ids_.count (chat_id) == 0) {
+        return false;
+      }
+      return true;
+    }
+
+    std::set<std::string> types_;
+    std::set<td::int64> chat_ids_;
+};
+
+struct CliStats {
+  td::uint64 updates_received = 0;
+  td::uint64 updates_filtered = 0;
+  td::uint64 updates_encoded = 0;
+  td::uint64 updates_encode_skipped = 0;
+  td::uint64 updates_dropped = 0;
+  td::uint64 updates_unchanged = 0;
+  td::uint64 requests_timed_out = 0;
+  td::uint64 requests_cancelled = 0;
+
+  std::string to_json (td::uint64 last_seq, const JsonEncoder::CheckStats &json_check) const {
+    return std::string ("{\"@type\":\"tdbotStats\"") +
+      ",\"last_seq\":" + std::to_string (last_seq) +
+      ",\"updates_received\":" + std::to_string (updates_received) +
+      ",\"updates_filtered\":" + std::to_string (updates_filtered) +
+      ",\"updates_encoded\":" + std::to_string (updates_encoded) +
+      ",\"updates_encode_skipped\":" + std::to_string (updates_encode_skipped) +
+      ",\"updates_dropped\":" + std::to_string (updates_dropped) +
+      ",\"updates_unchanged\":" + std::to_string (updates_unchanged) +
+      ",\"requests_timed_out\":" + std::to_string (requests_timed_out) +
+      ",\"requests_cancelled\":" + std::to_string (requests_cancelled) +
+      ",\"json_checked\":" + std::to_string (json_check.checked) +
+      ",\"json_mismatches\":" + std::to_string (json_check.mismatches) +
+      ",\"json_fast_seconds\":" + std::to_string (json_check.fast_seconds) +
+      ",\"json_to_json_seconds\":" + std::to_string (json_check.to_json_seconds) +
+      "}";
+  }
+};
+
+// Members of a group share the update stream. Updates of a chat stick to one
+// member, so per-chat ordering is kept; chats of a member that leaves are
+// handed out again on their next update. Only members whose filter accepts
+// an update are picked; if the owner of a chat filters one out, it goes to
+// another member without moving the chat.
+class ConsumerGroup {
+  public:
+    void add (td::uint64 member);
+    void remove (td::uint64 member);
+    // returns 0 if no member accepts the update
+    td::uint64 pick (td::int64 chat_id, const std::function<bool (td::uint64)> &accepts);
+    bool empty () const {
+      return members_.empty ();
+    }
+
+  private:
+    std::vector<td::uint64> members_;
+    std::unordered_map<td::int64, td::uint64> owners_;
+    std::unordered_map<td::uint64, size_t> load_;
+    size_t next_ = 0;
+};
+
+struct PendingQuery {
+  td::uint64 query_id;
+  td::tl_object_ptr<td::td_api::Function> cancel;
+};
+
 class CliFd {
   public:
     CliFd() {}
     void work(td::uint64 id);
     virtual void write(std::string str) = 0;
     virtual ~CliFd() = default;
+
+    UpdateFilter &filter () {
+      return filter_;
+    }
+    std::string &group () {
+      return group_;
+    }
+    std::string &journal_consumer () {
+      return journal_consumer_;
+    }
+    const JsonProjection *get_projection (const std::string &type) const {
+      auto it = projections_.find (type);
+      return it == projections_.end () ? nullptr : &it->second;
+    }
+    void set_projection (const std::string &type, JsonProjection projection) {
+      if (projection.empty ()) {
+        projections_.erase (type);
+      } else {
+        projections_[type] = std::move (projection);
+      }
+    }
+    std::unordered_map<std::string, PendingQuery> &pending () {
+      return pending_;
+    }
+
+    void set_delta_mode (bool enabled) {
+      delta_mode_ = enabled;
+      if (!enabled) {
+        delta_state_.clear ();
+      }
+    }
+    bool delta_mode () const {
+      return delta_mode_;
+    }
+    // replaces json by a tdbotUpdateDelta frame against the previously sent
+    // version of the same object; returns false if nothing changed
+    bool make_delta (const std::string &type, td::int64 key, std::string &json);
+
+    // a command line pointing into the input block it was read in; the
+    // block is shared by all commands split from the same read
+    struct Command {
+      std::shared_ptr<std::string> block;
+      td::MutableSlice text;
+    };
+    bool has_commands () const {
+      return !high_commands_.empty () || !commands_.empty ();
+    }
+    bool pop_command (Command &cmd);
+
+    static std::string get_delta_state_key (const std::string &type, td::int64 key) {
+      return type + ":" + std::to_string (key);
+    }
+
+    // returns false if an update had to be dropped to respect max_held_;
+    // delta_key is the get_delta_state_key of a delta mode frame
+    bool write_update (std::string str, std::string delta_key = std::string ());
+    // negative credits turn credit mode off; max_held of 0 keeps the limit
+    void grant_credits (td::int64 credits, size_t max_held);
+  protected:
+    bool split_commands (std::string &in);
   private:
     virtual void sock_sync () = 0;
     virtual void sock_read (td::uint64 id) = 0;
     virtual void sock_write (td::uint64 id) = 0;
     virtual void sock_close (td::uint64 id) = 0;
+
+    UpdateFilter filter_;
+    std::string group_;
+    std::string journal_consumer_;
+    std::unordered_map<std::string, PendingQuery> pending_;
+
+    std::deque<Command> high_commands_;
+    std::deque<Command> commands_;
+
+    bool delta_mode_ = false;
+    std::unordered_map<std::string, std::string> delta_state_;
+
+    bool credit_mode_ = false;
+    td::int64 credits_ = 0;
+    size_t max_held_ = 10000;
+    struct HeldUpdate {
+      std::string str;
+      std::string delta_key;
+    };
+    void drop_held ();
+    std::deque<HeldUpdate> held_;
+    std::map<std::string, JsonProjection> projections_;
 };
 
 class CliStdFd : public CliFd {
   public:
     explicit CliStdFd (CliClient *cli_);
     void write(std::string str) override {
-      out_ += str + "\n";
+      out_ += str;
+      out_ += '\n';
     }
     ~CliStdFd() override;
 
@@ -68,7 +237,8 @@ class CliSockFd : public CliFd {
   public:
     CliSockFd (td::SocketFd fd_, CliClient *cli_);
     void write(std::string str) override {
-      out_ += str + "\n";
+      out_ += str;
+      out_ += '\n';
     }
     ~CliSockFd() override;
 
@@ -86,7 +256,7 @@ class CliSockFd : public CliFd {
 
 class CliClient final : public td::Actor {
  public:
-  explicit CliClient(int port, std::string addr, std::string lua_script, bool login_mode, std::string phone, std::string bot_hash, td::TdParameters param) : port_(port), addr_(addr), lua_script_(lua_script), login_mode_ (login_mode), phone_ (phone), bot_hash_ (bot_hash), param_(param) {
+  explicit CliClient(int port, std::string addr, std::string lua_script, bool login_mode, std::string phone, std::string bot_hash, td::TdParameters param, int replay_blocks, std::string journal_dir, size_t journal_max_size, int lua_threads, int check_json, int commands_per_tick) : port_(port), addr_(addr), lua_script_(lua_script), login_mode_ (login_mode), phone_ (phone), bot_hash_ (bot_hash), param_(param), replay_blocks_ (replay_blocks), journal_dir_ (journal_dir), journal_max_size_ (journal_max_size), lua_threads_ (lua_threads), check_json_ (check_json), commands_per_tick_ (commands_per_tick) {
   }
 
   class TdAuthorizationStateCallback : public TdQueryCallback {
@@ -99,81 +269,64 @@ class CliClient final : public td::Actor {
   };
 
   class TdCmdCallback : public TdQueryCallback {
-    void on_result (td::tl_object_ptr<td::td_api::Object> result) override {
-      auto T = cli_->fds_.get (id_);
-      if (T) {
-        std::string v = td::json_encode<std::string>(td::ToJson (result));
-        T->get ()->write (v);
-        T->get ()->work (id_);
-      }
-    }
+    void on_result (td::tl_object_ptr<td::td_api::Object> result) override;
     void on_error (td::tl_object_ptr<td::td_api::error> error) override {
       on_result (td::move_tl_object_as<td::td_api::Object> (error));
     }
 
     td::uint64 id_;
     CliClient *cli_;
+    JsonProjection fields_;
+    std::string extra_;
+    size_t chunk_size_;
+    td::uint64 query_id_ = 0;
+
+    template <class T>
+    size_t write_chunks (std::vector<T> &items, td::Slice field);
     
     public:
-    TdCmdCallback(td::uint64 id, CliClient *cli) : id_ (id), cli_ (cli) {
+    TdCmdCallback(td::uint64 id, CliClient *cli, JsonProjection fields, std::string extra, size_t chunk_size) : id_ (id), cli_ (cli), fields_ (std::move (fields)), extra_ (std::move (extra)), chunk_size_ (chunk_size) {
+    }
+    void set_query_id (td::uint64 query_id) {
+      query_id_ = query_id;
     }
 
   };
 
+  class TdDropCallback : public TdQueryCallback {
+    void on_result (td::tl_object_ptr<td::td_api::Object> result) override {
+    }
+    void on_error (td::tl_object_ptr<td::td_api::error> error) override {
+    }
+  };
+
   
-  void send_request(td::tl_object_ptr<td::td_api::Function> f, std::unique_ptr<TdQueryCallback> handler) {
+  td::uint64 send_request(td::tl_object_ptr<td::td_api::Function> f, std::unique_ptr<TdQueryCallback> handler) {
     auto id = handlers_.create(std::move(handler));
     if (!td_.empty()) {
       send_closure(td_, &td::ClientActor::request, id, std::move(f));
     } else {
       LOG(ERROR) << "Failed to send: " << td::td_api::to_string(f);
     }
+    return id;
   };
+
+  // sends a tdbot_function request of a Lua state; the result goes back to its worker
+  void send_lua_request (int worker, int generation, td::tl_object_ptr<td::td_api::Function> function, int a1, int a2);
+  // makes every Lua worker load lua_script_ again, see LuaWorker::reload
+  void reload_script ();
+  void set_deadline (td::uint64 id, double timeout);
+  void dispatch_commands ();
+  bool cancel_query (PendingQuery query);
+  void leave_group (td::uint64 id);
+  void replay_updates (td::uint64 id, td::uint64 seq, const std::string &extra, bool from_journal);
   
   static CliClient *instance_;
 
-  void del_fd (td::uint64 id) {
-    fds_.erase (id);
-  }
+  void del_fd (td::uint64 id);
 
-  void run (td::uint64 id, std::string cmd) {
-    while (cmd.length () > 0 && isspace (cmd[0])) {
-      cmd = cmd.substr (1);
-    }
-    while (cmd.length () > 0 && isspace (cmd[cmd.length () - 1])) {
-      cmd = cmd.substr (0, cmd.length () - 1);
-    }
-    auto res = td::json_decode (cmd);
-   
-    if (res.is_ok ()) {
-      td::tl_object_ptr<td::td_api::Function> object;
-
-      auto r = from_json(object, res.move_as_ok ());
-
-      if (r.is_ok ()) {
-        send_request(std::move (object), std::make_unique<TdCmdCallback>(id,this));
-        return;
-      } else {
-        auto R = r.move_as_error ();
-
-        std::string er = std::string ("") +  "{\"_\":\"error\",\"code\":" + std::to_string (R.code ()) + ",\"message\":\"" + R.public_message () + "\"}";
-
-        if (fds_.get (id)) {
-          fds_.get (id)->get ()->write (er);
-        }
-        return;
-      }
-    }
-
-
-    auto R = res.move_as_error ();
-
-    std::string er = std::string ("") +  "{\"_\":\"error\",\"code\":" + std::to_string (R.code ()) + ",\"message\":\"" + R.public_message () + "\"}";
-    
-    if (fds_.get (id)) {
-      fds_.get (id)->get ()->write (er);
-    }
-  }
+  void run (td::uint64 id, td::MutableSlice cmd);
+  void schedule_loop ();
 
  private:
   void authentificate_restart ();
@@ -197,6 +350,10 @@ class CliClient final : public td::Actor {
   void tear_down() override;
 
   void on_update (td::tl_object_ptr<td::td_api::Update> update);
+  const std::string &get_update_type (const td::td_api::Update &update);
+  bool run_local (td::uint64 id, td::JsonValue &cmd);
+  void write_error (td::uint64 id, td::int32 code, std::string message, const std::string &extra = "");
+  void write_ok (td::uint64 id, const std::string &extra);
   void on_result (td::uint64 id, td::tl_object_ptr<td::td_api::Object> result);
   void on_error (td::uint64 id, td::tl_object_ptr<td::td_api::error> error);
 
@@ -225,11 +382,11 @@ class CliClient final : public td::Actor {
 
 
   bool inited_ = false;
+  bool loop_scheduled_ = false;
   void loop() override;
 
 
-  void timeout_expired() override {
-  }
+  void timeout_expired() override;
 
   /*void add_cmd(std::string cmd) {
     cmd_queue_.push(cmd);
@@ -239,13 +396,25 @@ class CliClient final : public td::Actor {
 
   int port_;
   std::string addr_;
-  CliLua *clua_ = nullptr;
+  // one state on this scheduler, or lua_threads_ states on schedulers of their own
+  std::vector<td::ActorOwn<LuaWorker>> lua_workers_;
   std::string lua_script_ = "";
   bool login_mode_ = false;
   std::string phone_;
   std::string bot_hash_;
 
   td::TdParameters param_;
+  int replay_blocks_;
+  std::string journal_dir_;
+  size_t journal_max_size_;
+  int lua_threads_;
+  // every check_json_-th encode is compared against ToJson, see JsonEncoder
+  int check_json_;
+  // commands run per connection before the next one gets its turn, see
+  // --commands-per-tick; higher values cut the per-pass flush and scheduling
+  // cost for pipelining clients, lower ones bound how long one busy
+  // connection delays the others and the update fan-out
+  int commands_per_tick_;
   td::ActorOwn<td::ClientActor> td_;
   //std::queue<std::string> cmd_queue_;
   bool close_flag_ = false;
@@ -254,4 +423,13 @@ class CliClient final : public td::Actor {
 
   td::Container<std::unique_ptr<CliFd>> fds_;
   td::Container<std::unique_ptr<TdQueryCallback>> handlers_;
+  TimerWheel deadlines_{0.1};
+  std::map<std::string, ConsumerGroup> groups_;
+  td::uint64 update_seq_ = 0;
+  std::unique_ptr<ReplayRing> replay_;
+  std::unique_ptr<Journal> journal_;
+  std::unordered_map<td::int32, std::string> update_type_names_;
+  CliStats stats_;
+  JsonEncoder encoder_;
+  JsonFragmentCache fragment_cache_;
 };
@@ -0,0 +1,790 @@
+#include "clijson.hpp"
+
+#include "td/utils/logging.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define TDBOT_JSON_SIMD 1
+#endif
+
+namespace {
+
+bool needs_escape (unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+size_t skip_ascii_scalar (const unsigned char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && s[i] < 0x80) {
+    i++;
+  }
+  return i;
+}
+
+size_t skip_unescaped_scalar (const unsigned char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && !needs_escape (s[i])) {
+    i++;
+  }
+  return i;
+}
+
+#ifdef TDBOT_JSON_SIMD
+size_t skip_ascii_sse2 (const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto x = _mm_loadu_si128 (reinterpret_cast<const __m128i *>(s + i));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8 (x));
+    if (mask != 0) {
+      return i + __builtin_ctz (mask);
+    }
+  }
+  return i + skip_ascii_scalar (s + i, n - i);
+}
+
+// control characters are the bytes with the top three bits clear
+size_t skip_unescaped_sse2 (const unsigned char *s, size_t n) {
+  auto quote = _mm_set1_epi8 ('"');
+  auto backslash = _mm_set1_epi8 ('\\');
+  auto control = _mm_set1_epi8 (static_cast<char>(0xe0));
+  auto zero = _mm_setzero_si128 ();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto x = _mm_loadu_si128 (reinterpret_cast<const __m128i *>(s + i));
+    auto m = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (x, quote), _mm_cmpeq_epi8 (x, backslash)),
+                           _mm_cmpeq_epi8 (_mm_and_si128 (x, control), zero));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8 (m));
+    if (mask != 0) {
+      return i + __builtin_ctz (mask);
+    }
+  }
+  return i + skip_unescaped_scalar (s + i, n - i);
+}
+
+// the tails run the SSE2 code, which is not VEX-encoded: without clearing the
+// upper halves first, every switch to it stalls, and short strings hardly
+// ever reach the 32-byte loop
+__attribute__((target ("avx2"))) size_t skip_ascii_avx2 (const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    auto x = _mm256_loadu_si256 (reinterpret_cast<const __m256i *>(s + i));
+    auto mask = static_cast<unsigned>(_mm256_movemask_epi8 (x));
+    if (mask != 0) {
+      return i + __builtin_ctz (mask);
+    }
+  }
+  _mm256_zeroupper ();
+  return i + skip_ascii_sse2 (s + i, n - i);
+}
+
+__attribute__((target ("avx2"))) size_t skip_unescaped_avx2 (const unsigned char *s, size_t n) {
+  auto quote = _mm256_set1_epi8 ('"');
+  auto backslash = _mm256_set1_epi8 ('\\');
+  auto control = _mm256_set1_epi8 (static_cast<char>(0xe0));
+  auto zero = _mm256_setzero_si256 ();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    auto x = _mm256_loadu_si256 (reinterpret_cast<const __m256i *>(s + i));
+    auto m = _mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (x, quote), _mm256_cmpeq_epi8 (x, backslash)),
+                              _mm256_cmpeq_epi8 (_mm256_and_si256 (x, control), zero));
+    auto mask = static_cast<unsigned>(_mm256_movemask_epi8 (m));
+    if (mask != 0) {
+      return i + __builtin_ctz (mask);
+    }
+  }
+  _mm256_zeroupper ();
+  return i + skip_unescaped_sse2 (s + i, n - i);
+}
+#endif
+
+struct StringKernels {
+  size_t (*skip_ascii) (const unsigned char *s, size_t n);
+  size_t (*skip_unescaped) (const unsigned char *s, size_t n);
+};
+
+StringKernels select_kernels () {
+#ifdef TDBOT_JSON_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) {
+    return {skip_ascii_avx2, skip_unescaped_avx2};
+  }
+  return {skip_ascii_sse2, skip_unescaped_sse2};
+#else
+  return {skip_ascii_scalar, skip_unescaped_scalar};
+#endif
+}
+
+StringKernels &kernels () {
+  static StringKernels k = select_kernels ();
+  return k;
+}
+
+// length of the well-formed UTF-8 sequence at s, or 0 if it is not one;
+// overlong forms, surrogates and code points above U+10FFFF are rejected
+size_t utf8_sequence_length (const unsigned char *s, size_t n) {
+  auto c = s[0];
+  if (c < 0x80) {
+    return 1;
+  }
+  size_t len;
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xbf;
+  if (c >= 0xc2 && c <= 0xdf) {
+    len = 2;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    len = 3;
+    if (c == 0xe0) {
+      lo = 0xa0;
+    } else if (c == 0xed) {
+      hi = 0x9f;
+    }
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    len = 4;
+    if (c == 0xf0) {
+      lo = 0x90;
+    } else if (c == 0xf4) {
+      hi = 0x8f;
+    }
+  } else {
+    return 0;
+  }
+  if (n < len || s[1] < lo || s[1] > hi) {
+    return 0;
+  }
+  for (size_t i = 2; i < len; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+bool is_valid_utf8 (const unsigned char *s, size_t n) {
+  auto &k = kernels ();
+  size_t i = 0;
+  while (true) {
+    i += k.skip_ascii (s + i, n - i);
+    // non-ASCII text usually stays non-ASCII for a while, so walk it here
+    // instead of bouncing back into the vector loop after every character
+    while (i < n && s[i] >= 0x80) {
+      auto len = utf8_sequence_length (s + i, n - i);
+      if (len == 0) {
+        return false;
+      }
+      i += len;
+    }
+    if (i == n) {
+      return true;
+    }
+  }
+}
+
+void append_escaped (std::string &out, unsigned char c) {
+  static const char hex[] = "0123456789abcdef";
+  switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\b':
+      out += "\\b";
+      break;
+    case '\f':
+      out += "\\f";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 15];
+  }
+}
+
+// slow path for strings that are not valid UTF-8: every byte that is not
+// part of a well-formed sequence becomes U+FFFD, so the output stays JSON
+void append_json_string_invalid (std::string &out, const unsigned char *s, size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    if (needs_escape (s[i])) {
+      append_escaped (out, s[i]);
+      i++;
+      continue;
+    }
+    auto len = utf8_sequence_length (s + i, n - i);
+    if (len == 0) {
+      out += "\xef\xbf\xbd";
+      i++;
+    } else {
+      out.append (reinterpret_cast<const char *>(s + i), len);
+      i += len;
+    }
+  }
+}
+
+// the sniffer only needs to find string ends and brackets; SSE2 is always
+// there on x86-64, so it does without runtime dispatch
+size_t find_quote_or_backslash (const unsigned char *s, size_t n) {
+  size_t i = 0;
+#ifdef TDBOT_JSON_SIMD
+  auto quote = _mm_set1_epi8 ('"');
+  auto backslash = _mm_set1_epi8 ('\\');
+  for (; i + 16 <= n; i += 16) {
+    auto x = _mm_loadu_si128 (reinterpret_cast<const __m128i *>(s + i));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (x, quote), _mm_cmpeq_epi8 (x, backslash))));
+    if (mask != 0) {
+      return i + __builtin_ctz (mask);
+    }
+  }
+#endif
+  while (i < n && s[i] != '"' && s[i] != '\\') {
+    i++;
+  }
+  return i;
+}
+
+bool is_structural (unsigned char c) {
+  return c == '"' || c == '{' || c == '}' || c == '[' || c == ']';
+}
+
+size_t find_structural (const unsigned char *s, size_t n) {
+  size_t i = 0;
+#ifdef TDBOT_JSON_SIMD
+  auto quote = _mm_set1_epi8 ('"');
+  // '[' and ']' are '{' and '}' with bit 0x20 cleared
+  auto fold = _mm_set1_epi8 (0x20);
+  auto open = _mm_set1_epi8 ('{');
+  auto close = _mm_set1_epi8 ('}');
+  for (; i + 16 <= n; i += 16) {
+    auto x = _mm_loadu_si128 (reinterpret_cast<const __m128i *>(s + i));
+    auto folded = _mm_or_si128 (x, fold);
+    auto m = _mm_or_si128 (_mm_cmpeq_epi8 (x, quote), _mm_or_si128 (_mm_cmpeq_epi8 (folded, open), _mm_cmpeq_epi8 (folded, close)));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8 (m));
+    if (mask != 0) {
+      return i + __builtin_ctz (mask);
+    }
+  }
+#endif
+  while (i < n && !is_structural (s[i])) {
+    i++;
+  }
+  return i;
+}
+
+size_t skip_whitespace (td::Slice json, size_t i) {
+  while (i < json.size () && (json[i] == ' ' || json[i] == '\t' || json[i] == '\n' || json[i] == '\r')) {
+    i++;
+  }
+  return i;
+}
+
+// i points at the opening quote; leaves it just past the closing one
+bool skip_string (td::Slice json, size_t &i) {
+  auto s = json.ubegin ();
+  auto n = json.size ();
+  i++;
+  while (true) {
+    if (i >= n) {
+      return false;
+    }
+    i += find_quote_or_backslash (s + i, n - i);
+    if (i >= n) {
+      return false;
+    }
+    if (s[i] == '\\') {
+      // a backslash ending the input escapes nothing
+      if (i + 1 >= n) {
+        return false;
+      }
+      i += 2;
+      continue;
+    }
+    i++;
+    return true;
+  }
+}
+
+bool skip_value (td::Slice json, size_t &i) {
+  auto s = json.ubegin ();
+  auto n = json.size ();
+  if (i >= n) {
+    return false;
+  }
+  if (s[i] == '"') {
+    return skip_string (json, i);
+  }
+  if (s[i] == '{' || s[i] == '[') {
+    int depth = 0;
+    while (true) {
+      if (i >= n) {
+        return false;
+      }
+      i += find_structural (s + i, n - i);
+      if (i >= n) {
+        return false;
+      }
+      switch (s[i]) {
+        case '"':
+          if (!skip_string (json, i)) {
+            return false;
+          }
+          continue;
+        case '{':
+        case '[':
+          depth++;
+          break;
+        default:
+          depth--;
+          break;
+      }
+      i++;
+      if (depth == 0) {
+        return true;
+      }
+    }
+  }
+  while (i < n && s[i] != ',' && s[i] != '}' && s[i] != ']' && s[i] != ' ' && s[i] != '\t' && s[i] != '\n' && s[i] != '\r') {
+    i++;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool set_json_string_kernel (JsonStringKernel kernel) {
+  switch (kernel) {
+    case JsonStringKernel::Auto:
+      kernels () = select_kernels ();
+      return true;
+    case JsonStringKernel::Scalar:
+      kernels () = {skip_ascii_scalar, skip_unescaped_scalar};
+      return true;
+#ifdef TDBOT_JSON_SIMD
+    case JsonStringKernel::Sse2:
+      kernels () = {skip_ascii_sse2, skip_unescaped_sse2};
+      return true;
+    case JsonStringKernel::Avx2:
+      __builtin_cpu_init ();
+      if (!__builtin_cpu_supports ("avx2")) {
+        return false;
+      }
+      kernels () = {skip_ascii_avx2, skip_unescaped_avx2};
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+void append_json_string (std::string &out, td::Slice str) {
+  auto s = str.ubegin ();
+  auto n = str.size ();
+  out.reserve (out.size () + n + 2);
+  out += '"';
+  if (!is_valid_utf8 (s, n)) {
+    append_json_string_invalid (out, s, n);
+  } else {
+    auto &k = kernels ();
+    size_t i = 0;
+    while (true) {
+      auto run = k.skip_unescaped (s + i, n - i);
+      out.append (str.data () + i, run);
+      i += run;
+      if (i == n) {
+        break;
+      }
+      append_escaped (out, s[i]);
+      i++;
+    }
+  }
+  out += '"';
+}
+
+size_t sniff_json_fields (td::Slice json, const td::Slice *keys, size_t key_count, td::Slice *values) {
+  for (size_t k = 0; k < key_count; k++) {
+    values[k] = td::Slice ();
+  }
+  size_t found = 0;
+  auto i = skip_whitespace (json, 0);
+  if (i >= json.size () || json[i] != '{') {
+    return 0;
+  }
+  i = skip_whitespace (json, i + 1);
+  if (i < json.size () && json[i] == '}') {
+    return 0;
+  }
+  while (found < key_count) {
+    if (i >= json.size () || json[i] != '"') {
+      break;
+    }
+    auto key_begin = i + 1;
+    if (!skip_string (json, i)) {
+      break;
+    }
+    auto key = json.substr (key_begin, i - 1 - key_begin);
+    i = skip_whitespace (json, i);
+    if (i >= json.size () || json[i] != ':') {
+      break;
+    }
+    i = skip_whitespace (json, i + 1);
+    auto value_begin = i;
+    if (!skip_value (json, i)) {
+      break;
+    }
+    auto value = json.substr (value_begin, i - value_begin);
+    if (value.size () >= 2 && value[0] == '"') {
+      value = value.substr (1, value.size () - 2);
+    }
+    for (size_t k = 0; k < key_count; k++) {
+      if (keys[k] == key && values[k].empty ()) {
+        values[k] = value;
+        found++;
+        break;
+      }
+    }
+    i = skip_whitespace (json, i);
+    if (i >= json.size () || json[i] != ',') {
+      break;
+    }
+    i = skip_whitespace (json, i + 1);
+  }
+  return found;
+}
+
+void append_json_value (std::string &out, const td::JsonValue &value) {
+  switch (value.type ()) {
+    case td::JsonValue::Type::Null:
+      out += "null";
+      break;
+    case td::JsonValue::Type::Number:
+      out.append (value.get_number ().begin (), value.get_number ().size ());
+      break;
+    case td::JsonValue::Type::Boolean:
+      out += value.get_boolean () ? "true" : "false";
+      break;
+    case td::JsonValue::Type::String:
+      append_json_string (out, value.get_string ());
+      break;
+    case td::JsonValue::Type::Array: {
+      out += '[';
+      bool first = true;
+      for (auto &v : value.get_array ()) {
+        if (!first) {
+          out += ',';
+        }
+        first = false;
+        append_json_value (out, v);
+      }
+      out += ']';
+      break;
+    }
+    case td::JsonValue::Type::Object: {
+      out += '{';
+      bool first = true;
+      for (auto &f : value.get_object ()) {
+        if (!first) {
+          out += ',';
+        }
+        first = false;
+        append_json_string (out, f.first);
+        out += ':';
+        append_json_value (out, f.second);
+      }
+      out += '}';
+      break;
+    }
+    default:
+      UNREACHABLE ();
+  }
+}
+
+void add_json_field (std::string &json, td::Slice key, td::Slice value) {
+  if (json.empty () || json.back () != '}') {
+    return;
+  }
+  json.pop_back ();
+  if (json.back () != '{') {
+    json += ',';
+  }
+  append_json_string (json, key);
+  json += ':';
+  json.append (value.begin (), value.size ());
+  json += '}';
+}
+
+void add_json_extra (std::string &json, const std::string &extra) {
+  if (!extra.empty ()) {
+    add_json_field (json, "@extra", extra);
+  }
+}
+
+static const td::JsonValue *find_json_field (const td::JsonValue &object, td::Slice name) {
+  for (auto &f : object.get_object ()) {
+    if (f.first == name) {
+      return &f.second;
+    }
+  }
+  return nullptr;
+}
+
+bool json_equal (const td::JsonValue &a, const td::JsonValue &b) {
+  if (a.type () != b.type ()) {
+    return false;
+  }
+  switch (a.type ()) {
+    case td::JsonValue::Type::Null:
+      return true;
+    case td::JsonValue::Type::Number:
+      return a.get_number () == b.get_number ();
+    case td::JsonValue::Type::Boolean:
+      return a.get_boolean () == b.get_boolean ();
+    case td::JsonValue::Type::String:
+      return a.get_string () == b.get_string ();
+    case td::JsonValue::Type::Array: {
+      auto &x = a.get_array ();
+      auto &y = b.get_array ();
+      if (x.size () != y.size ()) {
+        return false;
+      }
+      for (size_t i = 0; i < x.size (); i++) {
+        if (!json_equal (x[i], y[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case td::JsonValue::Type::Object: {
+      auto &x = a.get_object ();
+      auto &y = b.get_object ();
+      if (x.size () != y.size ()) {
+        return false;
+      }
+      for (auto &f : x) {
+        auto g = find_json_field (b, f.first);
+        if (!g || !json_equal (f.second, *g)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      UNREACHABLE ();
+      return false;
+  }
+}
+
+bool append_json_merge_patch (std::string &out, const td::JsonValue &from, const td::JsonValue &to) {
+  if (from.type () != td::JsonValue::Type::Object || to.type () != td::JsonValue::Type::Object) {
+    if (json_equal (from, to)) {
+      return false;
+    }
+    append_json_value (out, to);
+    return true;
+  }
+
+  auto begin = out.size ();
+  out += '{';
+  bool first = true;
+  auto add_key = [&](td::Slice key) {
+    if (!first) {
+      out += ',';
+    }
+    first = false;
+    append_json_string (out, key);
+    out += ':';
+  };
+
+  for (auto &f : to.get_object ()) {
+    auto old = find_json_field (from, f.first);
+    if (!old) {
+      add_key (f.first);
+      append_json_value (out, f.second);
+      continue;
+    }
+    auto pos = out.size ();
+    bool was_first = first;
+    add_key (f.first);
+    if (!append_json_merge_patch (out, *old, f.second)) {
+      out.resize (pos);
+      first = was_first;
+    }
+  }
+  for (auto &f : from.get_object ()) {
+    if (!find_json_field (to, f.first)) {
+      add_key (f.first);
+      out += "null";
+    }
+  }
+
+  if (first) {
+    out.resize (begin);
+    return false;
+  }
+  out += '}';
+  return true;
+}
+
+void JsonProjection::add_path (td::Slice path) {
+  if (path.empty ()) {
+    full_ = true;
+    return;
+  }
+  td::Slice name = path;
+  td::Slice rest;
+  for (size_t i = 0; i < path.size (); i++) {
+    if (path[i] == '.') {
+      name = path.substr (0, i);
+      rest = path.substr (i + 1);
+      break;
+    }
+  }
+
+  for (auto &child : children_) {
+    if (child.first == name) {
+      child.second.add_path (rest);
+      return;
+    }
+  }
+  children_.emplace_back (name.str (), JsonProjection ());
+  children_.back ().second.add_path (rest);
+}
+
+const JsonProjection *JsonProjection::get_child (td::Slice name) const {
+  for (auto &child : children_) {
+    if (child.first == name) {
+      return &child.second;
+    }
+  }
+  return nullptr;
+}
+
+void JsonProjection::store (std::string &out, const td::JsonValue &value) const {
+  if (keeps_all ()) {
+    append_json_value (out, value);
+    return;
+  }
+  if (value.type () == td::JsonValue::Type::Array) {
+    out += '[';
+    bool first = true;
+    for (auto &v : value.get_array ()) {
+      if (!first) {
+        out += ',';
+      }
+      first = false;
+      store (out, v);
+    }
+    out += ']';
+    return;
+  }
+  if (value.type () != td::JsonValue::Type::Object) {
+    append_json_value (out, value);
+    return;
+  }
+
+  out += '{';
+  bool first = true;
+  for (auto &f : value.get_object ()) {
+    const JsonProjection *child = nullptr;
+    if (f.first.empty () || f.first[0] != '@') {
+      child = get_child (f.first);
+      if (!child) {
+        continue;
+      }
+    }
+    if (!first) {
+      out += ',';
+    }
+    first = false;
+    append_json_string (out, f.first);
+    out += ':';
+    if (child) {
+      child->store (out, f.second);
+    } else {
+      append_json_value (out, f.second);
+    }
+  }
+  out += '}';
+}
+
+std::string JsonProjection::project (const std::string &json) const {
+  if (empty ()) {
+    return json;
+  }
+  std::string buf = json;
+  auto r = td::json_decode (buf);
+  if (r.is_error ()) {
+    LOG(ERROR) << "can not project json: " << r.error ();
+    return json;
+  }
+  std::string out;
+  out.reserve (json.size ());
+  store (out, r.ok ());
+  return out;
+}
+
+std::string JsonEncoder::acquire (size_t size) {
+  std::string buf;
+  if (!free_.empty ()) {
+    buf = std::move (free_.back ());
+    free_.pop_back ();
+  }
+  buf.resize (size);
+  return buf;
+}
+
+void JsonEncoder::release (std::string buf) {
+  if (free_.size () < max_pooled_ && buf.capacity () <= max_pooled_capacity_) {
+    buf.clear ();
+    free_.push_back (std::move (buf));
+  }
+}
+
+// a quarter of headroom over the average keeps retries rare for types whose
+// size varies, like messages
+size_t JsonEncoder::estimate (td::int32 type_id) const {
+  auto it = sizes_.find (type_id);
+  if (it == sizes_.end ()) {
+    return 1024;
+  }
+  return static_cast<size_t>(it->second * 1.25) + 64;
+}
+
+void JsonEncoder::update (td::int32 type_id, size_t size) {
+  auto it = sizes_.find (type_id);
+  if (it == sizes_.end ()) {
+    sizes_[type_id] = static_cast<double>(size);
+  } else {
+    it->second = it->second * 0.875 + static_cast<double>(size) * 0.125;
+  }
+}
+
+double JsonEncoder::check_start () {
+  if (check_every_ == 0) {
+    return 0;
+  }
+  if (check_countdown_ > 0) {
+    check_countdown_--;
+    return 0;
+  }
+  check_countdown_ = check_every_ - 1;
+  return td::Time::now ();
+}
+
+void JsonEncoder::check_finish (td::int32 type_id, const std::string &got, const std::string &expected, double fast_seconds, double to_json_seconds) {
+  check_stats_.checked++;
+  check_stats_.fast_seconds += fast_seconds;
+  check_stats_.to_json_seconds += to_json_seconds;
+  if (got != expected) {
+    check_stats_.mismatches++;
+    LOG(ERROR) << "generated encoder differs from ToJson for type " << type_id << ": " << got << " instead of " << expected;
+  }
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "td/utils/JsonBuilder.h"
+#include "td/utils/Slice.h"
+#include "td/utils/StringBuilder.h"
+#include "td/utils/Time.h"
+
+void append_json_string (std::string &out, td::Slice str);
+// The scan loops behind append_json_string; Auto, the default, is the widest
+// the CPU supports. Only for benchmarks: switching is not thread-safe.
+// Returns false if the kernel is not available on this CPU or build.
+enum class JsonStringKernel { Auto, Scalar, Sse2, Avx2 };
+bool set_json_string_kernel (JsonStringKernel kernel);
+// Finds selected top-level keys of a JSON object without building a DOM.
+// values[i] gets the raw text of keys[i]: strings without their quotes and
+// with escapes left in place, anything else verbatim; missing keys leave it
+// empty. Returns the number of keys found.
+size_t sniff_json_fields (td::Slice json, const td::Slice *keys, size_t key_count, td::Slice *values);
+void append_json_value (std::string &out, const td::JsonValue &value);
+void add_json_field (std::string &json, td::Slice key, td::Slice value);
+void add_json_extra (std::string &json, const std::string &extra);
+
+bool json_equal (const td::JsonValue &a, const td::JsonValue &b);
+// Appends an RFC 7396 merge patch turning from into to; returns false and
+// appends nothing if they are equal
+bool append_json_merge_patch (std::string &out, const td::JsonValue &from, const td::JsonValue &to);
+
+// Set of dotted field paths, e.g. "message.content.text.text". Keys starting
+// with '@' are always kept, so projected objects still carry their @type.
+class JsonProjection {
+  public:
+    void add_path (td::Slice path);
+    bool empty () const {
+      return !full_ && children_.empty ();
+    }
+    // true if values under this node are kept whole
+    bool keeps_all () const {
+      return full_ || children_.empty ();
+    }
+    void store (std::string &out, const td::JsonValue &value) const;
+    std::string project (const std::string &json) const;
+    const JsonProjection *get_child (td::Slice name) const;
+
+  private:
+    bool full_ = false;
+    std::vector<std::pair<std::string, JsonProjection>> children_;
+};
+
+// Pool of reusable encode buffers. A buffer is presized from a moving
+// average of the encoded size of its type id, so an encode normally writes
+// into memory that already fits instead of growing a fresh string.
+class JsonEncoder {
+  public:
+    template <class T>
+    std::string encode (td::int32 type_id, const T &object) {
+#if TDBOT_FAST_JSON
+      auto start = check_start ();
+      // the generated encoder appends, so reserving the estimate is enough
+      auto buf = acquire (0);
+      buf.reserve (estimate (type_id));
+      append_json (buf, object);
+      update (type_id, buf.size ());
+      if (start > 0) {
+        auto fast_end = td::Time::now ();
+        auto expected = encode_to_json (type_id, object);
+        check_finish (type_id, buf, expected, fast_end - start, td::Time::now () - fast_end);
+        release (std::move (expected));
+      }
+      return buf;
+#else
+      auto buf = encode_to_json (type_id, object);
+      update (type_id, buf.size ());
+      return buf;
+#endif
+    }
+    // encodes only what projection selects; the generated encoder never
+    // writes the other fields, ToJson output has to be projected afterwards
+    template <class T>
+    std::string encode (td::int32 type_id, const T &object, const JsonProjection &projection) {
+#if TDBOT_FAST_JSON
+      auto start = check_start ();
+      auto buf = acquire (0);
+      append_json (buf, object, projection);
+      if (start > 0) {
+        auto fast_end = td::Time::now ();
+        auto json = encode_to_json (type_id, object);
+        auto expected = projection.project (json);
+        release (std::move (json));
+        check_finish (type_id, buf, expected, fast_end - start, td::Time::now () - fast_end);
+      }
+      return buf;
+#else
+      auto json = encode (type_id, object);
+      auto buf = projection.project (json);
+      release (std::move (json));
+      return buf;
+#endif
+    }
+    // returns a buffer of the given size, reusing a released one if possible
+    std::string acquire (size_t size);
+    void release (std::string buf);
+
+    // With check_every set to n > 0, every nth encode is repeated through
+    // ToJson: outputs that differ are logged, and the time of both encoders
+    // is summed up for comparison.
+    struct CheckStats {
+      td::uint64 checked = 0;
+      td::uint64 mismatches = 0;
+      double fast_seconds = 0;
+      double to_json_seconds = 0;
+    };
+    void set_check_every (td::uint32 check_every) {
+      check_every_ = check_every;
+    }
+    const CheckStats &check_stats () const {
+      return check_stats_;
+    }
+
+  private:
+    template <class T>
+    std::string encode_to_json (td::int32 type_id, const T &object) {
+      auto buf = acquire (estimate (type_id));
+      while (true) {
+        td::JsonBuilder jb (td::StringBuilder (td::MutableSlice (&buf[0], buf.size ())), -1);
+        jb.enter_value () << td::ToJson (object);
+        auto &sb = jb.string_builder ();
+        if (!sb.is_error ()) {
+          buf.resize (sb.as_cslice ().size ());
+          return buf;
+        }
+        auto size = buf.size () * 2;
+        buf.clear ();
+        buf.resize (size);
+      }
+    }
+    // returns the start time of an encode to check, or 0
+    double check_start ();
+    void check_finish (td::int32 type_id, const std::string &got, const std::string &expected, double fast_seconds, double to_json_seconds);
+
+    size_t estimate (td::int32 type_id) const;
+    void update (td::int32 type_id, size_t size);
+
+    static constexpr size_t max_pooled_ = 64;
+    static constexpr size_t max_pooled_capacity_ = 1 << 20;
+    std::vector<std::string> free_;
+    std::unordered_map<td::int32, double> sizes_;
+
+    td::uint32 check_every_ = 0;
+    td::uint32 check_countdown_ = 0;
+    CheckStats check_stats_;
+};
@@ -1,206 +1,352 @@
 #include <assert.h>
 
 #include "clilua.hpp"
-#include "json.hpp"
 
-CliLua *CliLua::instance_ = nullptr;
+#include "auto/td_api_lua.h"
+#include "auto/td_api_lua_builder.h"
 
-using json = nlohmann::json;
+int lua_parse_function (lua_State *L) {
+  auto clua = static_cast<CliLua *>(lua_touserdata (L, lua_upvalueindex (1)));
+  if (lua_gettop (L) != 3) {
+    lua_pushboolean (L, 0);
+    return 1;
+  }
+  
+  int a1 = luaL_ref (L, LUA_REGISTRYINDEX);
+  int a2 = luaL_ref (L, LUA_REGISTRYINDEX);
+  
+  td::tl_object_ptr<td::td_api::Function> object;
+  auto r = td::from_lua (L, -1, object);
+  lua_pop (L, 1);
 
-void parse_json (lua_State *L, json &res) {
-  if (lua_isboolean (L, -1)) {
-    res = static_cast<bool>(lua_toboolean (L, -1));
-    return;
-  } else if (lua_type (L, -1) == LUA_TNUMBER) {
-    auto x = lua_tonumber (L, -1);
-    auto x64 = static_cast<td::int64>(x);
-    if (x == static_cast<double>(x64)) {
-      res = x64;
-    } else {
-      res = x;
-    }
-    return;
-  } else if (lua_isstring (L, -1)) {
-    size_t len;
-    const char *s = lua_tolstring (L, -1, &len);
-    res = std::string (s, len);
-    return;
-  } else if (lua_istable (L, -1)) {
-    
-    bool arr = true;
-    int size = 0;
+  if (r.is_error ()) {
+    LOG(ERROR) << "FAILED TO PARSE LUA: " << r << "\n";
+    luaL_unref (L, LUA_REGISTRYINDEX, a1);
+    luaL_unref (L, LUA_REGISTRYINDEX, a2);
+    lua_pushboolean (L, 0);
+    return 1;
+  }
 
-    lua_pushnil (L);
-    while (lua_next (L, -2)) {
-      if (!(arr && lua_type (L, -2) == LUA_TNUMBER && lua_tointeger (L, -2) == size)) {
-        arr = false;
-      }
-      size ++;
-      lua_pop (L, 1);
-    }
+  clua->send_request (std::move (object), a1, a2);
+  lua_pushboolean (L, 1);
+  return 1;
+}
 
-    if (arr) {
-      res = json::array ();
-    } else {
-      res = json::object ();
-    }
-   
-    lua_pushnil (L);
-    while (lua_next (L, -2)) {
-      if (arr) {
-        int x = (int)lua_tointeger (L, -2);
-        parse_json (L, res[x]);
-        lua_pop (L, 1);
-      } else {
-        size_t len;
-
-        if (lua_type (L, -2) == LUA_TNUMBER) {
-          auto x = lua_tointeger (L, -2);
-          std::string k = std::to_string (x);
-          parse_json (L, res[k]);
-        } else {
-          const char *key = lua_tolstring (L, -2, &len);
-          std::string k = std::string (key, len);
-          parse_json (L, res[k]);
-        }
-        lua_pop (L, 1);
-      }
-    }
+// tdbot_table (value): turns an update proxy into a plain table, other values
+// are returned as they are
+int lua_proxy_to_table (lua_State *L) {
+  auto object = td::get_lua_proxy (L, 1);
+  if (object == nullptr) {
+    lua_settop (L, 1);
   } else {
-    res = false;
-    return;
+    td::to_lua (L, *object);
   }
+  return 1;
 }
 
-void push_json (lua_State *L, json &j) {
-  if (j.is_null ()) {
-    lua_pushnil (L);
-  } else if (j.is_boolean ()) {
-    lua_pushboolean (L, j.get<bool>());
-  } else if (j.is_string ()) {
-    auto s = j.get<std::string>();
-    lua_pushlstring (L, s.c_str (), s.length ());
-  } else if (j.is_number_integer ()) {
-    auto v = j.get<td::int64>();
-
-    if (v == static_cast<int>(v)) {
-      lua_pushnumber (L, static_cast<int>(v));
-    } else {
-      std::string s = std::to_string (v);
-      lua_pushlstring (L, s.c_str (), s.length ());
-    }
-  } else if (j.is_number_float ()) {
-    auto v = j.get<double>();
-    lua_pushnumber (L, v);
-  } else if (j.is_array ()) {
-    lua_newtable (L);
-    int p = 0;
-    for (auto it = j.begin (); it != j.end (); it ++, p ++) {
-      lua_pushnumber (L, p);
-      push_json (L, *it);
-      lua_settable (L, -3);
-    }
-  } else if (j.is_object ()) {
-    lua_newtable (L);
-    for (auto it = j.begin (); it != j.end (); it ++) {
-      auto s = it.key ();
+namespace {
+// update passed to the running tdbot_update_callback of this thread
+struct RawUpdate {
+  const td::td_api::Object *object = nullptr;
+  bool encoded = false;
+  std::string json;
+  JsonEncoder encoder;
+};
+thread_local RawUpdate raw_update;
+}  // namespace
 
-      lua_pushlstring (L, s.c_str (), s.length ());
-      push_json (L, it.value ());
-      lua_settable (L, -3);
-    }
-  } else {
-    lua_pushnil (L);
+const char *tdbot_update_json (size_t *size) {
+  auto &raw = raw_update;
+  if (raw.object == nullptr) {
+    *size = 0;
+    return nullptr;
   }
+  if (!raw.encoded) {
+    raw.json = raw.encoder.encode (raw.object->get_id (), *raw.object);
+    raw.encoded = true;
+  }
+  *size = raw.json.size ();
+  return raw.json.c_str ();
 }
 
-int lua_parse_function (lua_State *L) {
-  if (lua_gettop (L) != 3) {
-    lua_pushboolean (L, 0);
-    return 1;
+int tdbot_update_id (void) {
+  return raw_update.object == nullptr ? 0 : raw_update.object->get_id ();
+}
+
+// lua_resume changed its signature in 5.2 and again in 5.4
+static int resume_coroutine (lua_State *co, lua_State *from, int nargs) {
+#if LUA_VERSION_NUM >= 504
+  int nresults;
+  return lua_resume (co, from, nargs, &nresults);
+#elif LUA_VERSION_NUM >= 502
+  return lua_resume (co, from, nargs);
+#else
+  return lua_resume (co, nargs);
+#endif
+}
+
+// tdbot_call (request): sends request and suspends the running coroutine
+// until its result arrives, which tdbot_call then returns; returns nil and
+// an error message if request is malformed
+int lua_call_function (lua_State *L) {
+  auto clua = static_cast<CliLua *>(lua_touserdata (L, lua_upvalueindex (1)));
+  if (lua_pushthread (L)) {
+    return luaL_error (L, "tdbot_call must be called from a coroutine");
   }
-  
-  int a1 = luaL_ref (L, LUA_REGISTRYINDEX);
-  int a2 = luaL_ref (L, LUA_REGISTRYINDEX);
-  
-  json j;
-  parse_json (L, j);
   lua_pop (L, 1);
 
-  auto cmd = j.dump ();
-  
-  LOG(INFO) << cmd << "\n";
-  
-  auto res = td::json_decode (cmd);
-
-  if (res.is_ok ()) {
-    td::tl_object_ptr<td::td_api::Function> object;
+  std::vector<td::tl_object_ptr<td::td_api::Function>> functions (1);
+  auto r = td::from_lua (L, 1, functions[0]);
+  if (r.is_error ()) {
+    lua_pushnil (L);
+    lua_pushstring (L, r.message ().c_str ());
+    return 2;
+  }
+  clua->await (L, std::move (functions), false);
+  return lua_yield (L, 0);
+}
 
-    auto r = from_json(object, res.move_as_ok ());
+// tdbot_await_all ({request, ...}): sends all requests at once and returns a
+// table with the result of each request under the same index
+int lua_await_all (lua_State *L) {
+  auto clua = static_cast<CliLua *>(lua_touserdata (L, lua_upvalueindex (1)));
+  if (lua_pushthread (L)) {
+    return luaL_error (L, "tdbot_await_all must be called from a coroutine");
+  }
+  lua_pop (L, 1);
+  luaL_checktype (L, 1, LUA_TTABLE);
 
-    if (r.is_ok ()) {
-      CliClient::instance_->send_request(std::move (object), std::make_unique<TdLuaCallback>(a1, a2, CliLua::instance_));
-      lua_pushboolean (L, 1);
-      return 1;
-    } else {
-      LOG(ERROR) << "FAILED TO PARSE LUA: " << r.move_as_error () << "\n";
-      lua_pushboolean (L, 0);
-      return 1;
+  std::vector<td::tl_object_ptr<td::td_api::Function>> functions;
+  for (int i = 1;; i++) {
+    lua_rawgeti (L, 1, i);
+    if (lua_isnil (L, -1)) {
+      lua_pop (L, 1);
+      break;
+    }
+    functions.emplace_back ();
+    auto r = td::from_lua (L, -1, functions.back ());
+    lua_pop (L, 1);
+    if (r.is_error ()) {
+      lua_pushnil (L);
+      lua_pushfstring (L, "request %d: %s", i, r.message ().c_str ());
+      return 2;
     }
   }
-  
-  LOG(ERROR) << "FAILED TO PARSE LUA: " << res.move_as_error () << "\n";
-
-  lua_pushboolean (L, 0);
-  return 1;
+  if (functions.empty ()) {
+    lua_newtable (L);
+    return 1;
+  }
+  clua->await (L, std::move (functions), true);
+  return lua_yield (L, 0);
 }
 
-CliLua::CliLua (std::string file) {
-  instance_ = this;
-  
+CliLua::CliLua (td::ActorId<CliClient> client, int worker, int generation) : client_ (client), worker_ (worker), generation_ (generation) {
   luaState_ = luaL_newstate ();
   luaL_openlibs (luaState_);
   
-  lua_register (luaState_, "tdbot_function", lua_parse_function);
+  // the state may run on any scheduler thread, so tdbot_function finds its
+  // CliLua through an upvalue instead of a global instance
+  lua_pushlightuserdata (luaState_, this);
+  lua_pushcclosure (luaState_, lua_parse_function, 1);
+  lua_setglobal (luaState_, "tdbot_function");
+  lua_pushlightuserdata (luaState_, this);
+  lua_pushcclosure (luaState_, lua_call_function, 1);
+  lua_setglobal (luaState_, "tdbot_call");
+  lua_pushlightuserdata (luaState_, this);
+  lua_pushcclosure (luaState_, lua_await_all, 1);
+  lua_setglobal (luaState_, "tdbot_await_all");
+  lua_register (luaState_, "tdbot_table", lua_proxy_to_table);
+}
+
+CliLua::~CliLua () {
+  lua_close (luaState_);
+}
 
+td::Status CliLua::load (const std::string &file) {
   int r = luaL_dofile (luaState_, file.c_str ());
 
   if (r) {
-    LOG(FATAL) << "lua: " << lua_tostring (luaState_, -1) << "\n";
+    auto error = td::Status::Error (std::string ("lua: ") + lua_tostring (luaState_, -1));
+    lua_settop (luaState_, 0);
+    return error;
   }
-}
 
-void CliLua::update (std::string update) {
-  auto j = json::parse (update);
+  lua_getglobal (luaState_, "tdbot_lazy_updates");
+  lazy_updates_ = lua_toboolean (luaState_, -1) != 0;
+  lua_pop (luaState_, 1);
+
+  lua_getglobal (luaState_, "tdbot_async_updates");
+  async_updates_ = lua_toboolean (luaState_, -1) != 0;
+  lua_pop (luaState_, 1);
+  return td::Status::OK ();
+}
 
+void CliLua::update (td::tl_object_ptr<td::td_api::Object> update) {
   lua_settop (luaState_, 0);
-  lua_getglobal (luaState_, "tdbot_update_callback");
 
-  push_json (luaState_, j);
+  // async scripts get a coroutine per update, so the callback may use
+  // tdbot_call; it is anchored by tdbot_call while it waits
+  auto L = async_updates_ ? lua_newthread (luaState_) : luaState_;
+  lua_getglobal (L, "tdbot_update_callback");
+
+  std::shared_ptr<const td::td_api::Object> root (update.release ());
+  if (lazy_updates_) {
+    td::push_lua_proxy (L, root, *root);
+  } else {
+    td::to_lua (L, *root);
+  }
+  raw_update.object = root.get ();
   
-  int r = lua_pcall (luaState_, 1, 0, 0);
+  int r;
+  if (async_updates_) {
+    r = resume_coroutine (L, luaState_, 1);
+    if (r == LUA_YIELD) {
+      r = 0;
+    }
+  } else {
+    r = lua_pcall (L, 1, 0, 0);
+  }
+
+  raw_update.object = nullptr;
+  if (raw_update.encoded) {
+    raw_update.encoder.release (std::move (raw_update.json));
+    raw_update.encoded = false;
+  }
 
   if (r) {
-    LOG(FATAL) << "lua: " <<  lua_tostring (luaState_, -1) << "\n";
+    LOG(FATAL) << "lua: " <<  lua_tostring (L, -1) << "\n";
+  }
+
+  lua_settop (luaState_, 0);
+}
+
+void CliLua::await (lua_State *L, std::vector<td::tl_object_ptr<td::td_api::Function>> functions, bool all) {
+  auto id = ++last_await_id_;
+  auto &await = awaits_[id];
+  lua_pushthread (L);
+  await.thread = luaL_ref (L, LUA_REGISTRYINDEX);
+  if (all) {
+    lua_createtable (L, static_cast<int>(functions.size ()), 0);
+    await.results = luaL_ref (L, LUA_REGISTRYINDEX);
+  }
+  await.remaining = functions.size ();
+  for (size_t i = 0; i < functions.size (); i++) {
+    auto call = ++last_call_id_;
+    calls_[call] = std::make_pair (id, static_cast<int>(i) + 1);
+    send_request (std::move (functions[i]), LUA_NOREF, call);
+  }
+}
+
+void CliLua::resume (int call, const td::td_api::Object &result) {
+  auto call_it = calls_.find (call);
+  if (call_it == calls_.end ()) {
+    return;
+  }
+  auto await_it = awaits_.find (call_it->second.first);
+  auto index = call_it->second.second;
+  calls_.erase (call_it);
+  if (await_it == awaits_.end ()) {
+    return;
+  }
+  auto &await = await_it->second;
+  if (await.results != LUA_NOREF) {
+    lua_rawgeti (luaState_, LUA_REGISTRYINDEX, await.results);
+    td::to_lua (luaState_, result);
+    lua_rawseti (luaState_, -2, index);
+    lua_pop (luaState_, 1);
+  }
+  if (--await.remaining > 0) {
+    return;
+  }
+
+  lua_settop (luaState_, 0);
+  // the thread stays on this stack while it runs, so it can not be collected
+  lua_rawgeti (luaState_, LUA_REGISTRYINDEX, await.thread);
+  auto co = lua_tothread (luaState_, -1);
+  luaL_unref (luaState_, LUA_REGISTRYINDEX, await.thread);
+  if (await.results != LUA_NOREF) {
+    lua_rawgeti (co, LUA_REGISTRYINDEX, await.results);
+    luaL_unref (luaState_, LUA_REGISTRYINDEX, await.results);
+  } else {
+    td::to_lua (co, result);
   }
+  awaits_.erase (await_it);
 
+  int r = resume_coroutine (co, luaState_, 1);
+  if (r != 0 && r != LUA_YIELD) {
+    LOG(FATAL) << "lua: " <<  lua_tostring (co, -1) << "\n";
+  }
+  lua_settop (luaState_, 0);
 }
   
+void CliLua::send_request (td::tl_object_ptr<td::td_api::Function> function, int a1, int a2) {
+  pending_++;
+  td::send_closure (client_, &CliClient::send_lua_request, worker_, generation_, std::move (function), a1, a2);
+}
+
 void TdLuaCallback::on_result (td::tl_object_ptr<td::td_api::Object> result) {
-  std::string v = td::json_encode<std::string>(td::ToJson (result));
+  td::send_closure (worker_, &LuaWorker::result, std::move (result), generation_, a1_, a2_);
+}
 
-  clua_->result (v, a1_, a2_);
+void LuaWorker::start_up () {
+  clua_ = std::make_unique<CliLua> (client_, index_, ++generation_);
+  auto r = clua_->load (script_);
+  if (r.is_error ()) {
+    LOG(FATAL) << r.message ();
+  }
 }
 
-void CliLua::result (std::string update, int a1, int a2) {
-  auto j = json::parse (update);
+void LuaWorker::reload () {
+  auto clua = std::make_unique<CliLua> (client_, index_, ++generation_);
+  auto r = clua->load (script_);
+  if (r.is_error ()) {
+    LOG(ERROR) << "reload of " << script_ << " failed, keeping the running script: " << r.message ();
+    retire (std::move (clua));
+    return;
+  }
+  LOG(INFO) << "worker " << index_ << " reloaded " << script_ << " as generation " << generation_;
+  std::swap (clua_, clua);
+  retire (std::move (clua));
+}
+
+void LuaWorker::retire (std::unique_ptr<CliLua> clua) {
+  if (clua->pending () > 0) {
+    draining_.push_back (std::move (clua));
+  }
+}
 
+void LuaWorker::update (td::tl_object_ptr<td::td_api::Object> update) {
+  clua_->update (std::move (update));
+}
+
+void LuaWorker::result (td::tl_object_ptr<td::td_api::Object> result, int generation, int a1, int a2) {
+  if (generation == clua_->generation ()) {
+    clua_->result (*result, a1, a2);
+    return;
+  }
+  for (auto it = draining_.begin (); it != draining_.end (); ++it) {
+    if ((*it)->generation () == generation) {
+      (*it)->result (*result, a1, a2);
+      if ((*it)->pending () == 0) {
+        draining_.erase (it);
+      }
+      return;
+    }
+  }
+}
+
+void CliLua::result (const td::td_api::Object &result, int a1, int a2) {
+  pending_--;
+  if (a1 == LUA_NOREF) {
+    resume (a2, result);
+    return;
+  }
   lua_settop (luaState_, 0);
 
   lua_rawgeti (luaState_, LUA_REGISTRYINDEX, a2);
   lua_rawgeti (luaState_, LUA_REGISTRYINDEX, a1);
  
-  push_json (luaState_, j);
+  td::to_lua (luaState_, result);
 
   int r = lua_pcall (luaState_, 2, 0, 0);
 
@@ -3,18 +3,98 @@
 #include "cliclient.hpp"
 
 #include <lua.hpp>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 class CliClient;
 
 class CliLua {
   public:
-    CliLua (std::string file);
-    void update(std::string upd);
-    void result(std::string result, int a1, int a2);
-    static CliLua *instance_;
+    // worker is the index of the LuaWorker owning this state; tdbot_function
+    // requests are sent to client on its behalf, tagged with generation so
+    // that results reach this state even after a reload replaced it
+    CliLua (td::ActorId<CliClient> client, int worker, int generation);
+    ~CliLua ();
+    // runs the script; on error the state must not be used for updates
+    td::Status load (const std::string &file);
+    int generation () const {
+      return generation_;
+    }
+    // requests whose results have not arrived yet
+    size_t pending () const {
+      return pending_;
+    }
+    void update(td::tl_object_ptr<td::td_api::Object> update);
+    void result(const td::td_api::Object &result, int a1, int a2);
+    void send_request (td::tl_object_ptr<td::td_api::Function> function, int a1, int a2);
+    // sends functions on behalf of coroutine L, which is resumed once all of
+    // their results are in; results of such calls come with a1 == LUA_NOREF
+    void await (lua_State *L, std::vector<td::tl_object_ptr<td::td_api::Function>> functions, bool all);
   private:
+    void resume (int call, const td::td_api::Object &result);
+
+    struct Await {
+      int thread = LUA_NOREF;
+      int results = LUA_NOREF;
+      size_t remaining = 0;
+    };
+
     lua_State *luaState_;
+    td::ActorId<CliClient> client_;
+    int worker_;
+    int generation_;
+    size_t pending_ = 0;
+    // set by the script through the global tdbot_lazy_updates; updates are
+    // then passed as proxies instead of tables
+    bool lazy_updates_ = false;
+    // set through tdbot_async_updates; each update callback runs in a coroutine
+    bool async_updates_ = false;
+    int last_await_id_ = 0;
+    int last_call_id_ = 0;
+    std::unordered_map<int, Await> awaits_;
+    // call id -> await id and index of the call in it
+    std::unordered_map<int, std::pair<int, int>> calls_;
+};
+
+// Plain C view of the update being handled, meant for LuaJIT's FFI:
+//   ffi.cdef [[
+//     const char *tdbot_update_json (size_t *size);
+//     int tdbot_update_id (void);
+//   ]]
+// tdbot_update_json encodes the update on first use and returns its JSON,
+// tdbot_update_id its td_api constructor id. Both are valid only until
+// tdbot_update_callback returns or yields; otherwise they return NULL and 0.
+extern "C" {
+const char *tdbot_update_json (size_t *size);
+int tdbot_update_id (void);
+}
+
+// Owns one Lua state and runs it on its scheduler. CliClient routes updates
+// to workers by chat_id, so updates of one chat are handled in order.
+class LuaWorker final : public td::Actor {
+  public:
+    LuaWorker (std::string script, td::ActorId<CliClient> client, int index) : script_ (script), client_ (client), index_ (index) {
+    }
+    void update (td::tl_object_ptr<td::td_api::Object> update);
+    void result (td::tl_object_ptr<td::td_api::Object> result, int generation, int a1, int a2);
+    // loads the script into a new state that takes over updates; the old
+    // state is kept until the results of its requests are in. If the script
+    // fails to load, the old state stays in charge.
+    void reload ();
+  private:
+    void start_up () override;
+    void retire (std::unique_ptr<CliLua> clua);
+
+    std::string script_;
+    td::ActorId<CliClient> client_;
+    int index_;
+    int generation_ = 0;
+    std::unique_ptr<CliLua> clua_;
+    // replaced states that still wait for results
+    std::vector<std::unique_ptr<CliLua>> draining_;
 };
 
 class TdLuaCallback : public TdQueryCallback {
@@ -23,11 +103,11 @@ class TdLuaCallback : public TdQueryCallback {
     on_result (td::move_tl_object_as<td::td_api::Object> (error));
   }
 
-  int a1_, a2_;
-  CliLua *clua_;
-  
+  int generation_, a1_, a2_;
+  td::ActorId<LuaWorker> worker_;
+
   public:
-  TdLuaCallback(int a1, int a2, CliLua *clua) : a1_(a1), a2_(a2), clua_ (clua) {
+  TdLuaCallback(int generation, int a1, int a2, td::ActorId<LuaWorker> worker) : generation_ (generation), a1_(a1), a2_(a2), worker_ (worker) {
   }
 
 };
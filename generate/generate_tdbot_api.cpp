@@ -0,0 +1,23 @@
+#include "td/tl/tl_config.h"
+#include "td/tl/tl_generate.h"
+#include "td/tl/tl_simple.h"
+
+#include "tl_json_encoder.h"
+#include "tl_lua_builder.h"
+#include "tl_lua_converter.h"
+
+#include <iostream>
+
+int main (int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " <td_api.tlo> <output directory>\n";
+    return 1;
+  }
+  td::tl::simple::Schema schema (td::tl::read_tl_config_from_file (argv[1]));
+  std::string dir = argv[2];
+
+  tdbot::gen_json_encoder (schema, dir + "/td_api_json_fast");
+  tdbot::gen_lua_converter (schema, dir + "/td_api_lua");
+  tdbot::gen_lua_builder (schema, dir + "/td_api_lua_builder");
+  return 0;
+}
@@ -0,0 +1,351 @@
+#include "tl_json_encoder.h"
+
+#include <fstream>
+#include <sstream>
+
+namespace tdbot {
+
+using td::tl::simple::Constructor;
+using td::tl::simple::CustomType;
+using td::tl::simple::Schema;
+using td::tl::simple::Type;
+using td::tl::simple::gen_cpp_field_name;
+using td::tl::simple::gen_cpp_name;
+
+static std::string indent (int depth) {
+  return std::string (2 * depth, ' ');
+}
+
+// C++ string literal for raw JSON text
+static std::string literal (const std::string &text) {
+  std::string res = "\"";
+  for (auto c : text) {
+    if (c == '"' || c == '\\') {
+      res += '\\';
+    }
+    res += c;
+  }
+  return res + "\"";
+}
+
+// collects constant JSON text so that adjacent keys and punctuation are
+// written with a single append
+class LiteralWriter {
+  public:
+    explicit LiteralWriter (std::ostream &out) : out_ (out) {
+    }
+    void add (const std::string &text) {
+      pending_ += text;
+    }
+    void flush (int depth) {
+      if (!pending_.empty ()) {
+        out_ << indent (depth) << "append_literal (out, " << literal (pending_) << ");\n";
+        pending_.clear ();
+      }
+    }
+
+  private:
+    std::ostream &out_;
+    std::string pending_;
+};
+
+// emits code appending expr of TL type; constant text before it must be flushed
+static void gen_value (std::ostream &out, const Type *type, const std::string &expr, int depth, int level) {
+  auto ind = indent (depth);
+  switch (type->type) {
+    case Type::Int32:
+    case Type::Int53:
+      out << ind << "append_integer (out, " << expr << ");\n";
+      break;
+    case Type::Int64:
+      out << ind << "out += '\"';\n";
+      out << ind << "append_integer (out, " << expr << ");\n";
+      out << ind << "out += '\"';\n";
+      break;
+    case Type::Double:
+      out << ind << "append_double (out, " << expr << ");\n";
+      break;
+    case Type::Bool:
+      out << ind << "append_bool (out, " << expr << ");\n";
+      break;
+    case Type::String:
+    case Type::SecureString:
+      out << ind << "::append_json_string (out, " << expr << ");\n";
+      break;
+    case Type::Bytes:
+    case Type::SecureBytes:
+      out << ind << "append_bytes (out, " << expr << ");\n";
+      break;
+    case Type::Vector: {
+      auto v = "v" + std::to_string (level);
+      auto i = "i" + std::to_string (level);
+      out << ind << "{\n";
+      out << ind << "  auto &" << v << " = " << expr << ";\n";
+      out << ind << "  out += '[';\n";
+      out << ind << "  for (size_t " << i << " = 0; " << i << " < " << v << ".size (); " << i << "++) {\n";
+      out << ind << "    if (" << i << " != 0) {\n";
+      out << ind << "      out += ',';\n";
+      out << ind << "    }\n";
+      gen_value (out, type->vector_value_type, v + "[" + i + "]", depth + 2, level + 1);
+      out << ind << "  }\n";
+      out << ind << "  out += ']';\n";
+      out << ind << "}\n";
+      break;
+    }
+    case Type::Custom:
+      out << ind << "append_json (out, " << expr << ");\n";
+      break;
+    default:
+      out << ind << "append_literal (out, \"null\");\n";
+      break;
+  }
+}
+
+// like gen_value, but objects are written through projection, an expression
+// of type const JsonProjection &
+static void gen_projected_value (std::ostream &out, const Type *type, const std::string &expr, const std::string &projection, int depth, int level) {
+  auto ind = indent (depth);
+  switch (type->type) {
+    case Type::Vector: {
+      auto v = "v" + std::to_string (level);
+      auto i = "i" + std::to_string (level);
+      out << ind << "{\n";
+      out << ind << "  auto &" << v << " = " << expr << ";\n";
+      out << ind << "  out += '[';\n";
+      out << ind << "  for (size_t " << i << " = 0; " << i << " < " << v << ".size (); " << i << "++) {\n";
+      out << ind << "    if (" << i << " != 0) {\n";
+      out << ind << "      out += ',';\n";
+      out << ind << "    }\n";
+      gen_projected_value (out, type->vector_value_type, v + "[" + i + "]", projection, depth + 2, level + 1);
+      out << ind << "  }\n";
+      out << ind << "  out += ']';\n";
+      out << ind << "}\n";
+      break;
+    }
+    case Type::Custom:
+      out << ind << "append_json (out, " << expr << ", " << projection << ");\n";
+      break;
+    default:
+      gen_value (out, type, expr, depth, level);
+      break;
+  }
+}
+
+// objects that are encoded over and over while rarely changing; their JSON
+// is kept in JsonFragmentCache, keyed by the id field
+static const char *get_cache_kind (const Constructor *constructor) {
+  bool has_id = false;
+  for (auto &arg : constructor->args) {
+    has_id |= arg.name == "id";
+  }
+  if (!has_id) {
+    return nullptr;
+  }
+  if (constructor->name == "user") {
+    return "User";
+  }
+  if (constructor->name == "chat") {
+    return "Chat";
+  }
+  if (constructor->name == "file") {
+    return "File";
+  }
+  return nullptr;
+}
+
+static void gen_cached (std::ostream &out, const std::string &name, const char *kind) {
+  out << "void append_json (std::string &out, const " << name << " &object) {\n"
+      << "  auto cache = JsonFragmentCache::instance_;\n"
+      << "  if (cache == nullptr) {\n"
+      << "    append_json_uncached (out, object);\n"
+      << "  } else if (!cache->begin (out, JsonFragmentCache::Kind::" << kind << ", object.id_)) {\n"
+      << "    append_json_uncached (out, object);\n"
+      << "    cache->end (out);\n"
+      << "  }\n"
+      << "}\n\n";
+}
+
+static void gen_constructor (std::ostream &out, const Constructor *constructor) {
+  auto name = gen_cpp_name (constructor->name);
+  auto cache_kind = get_cache_kind (constructor);
+  if (cache_kind != nullptr) {
+    out << "static void append_json_uncached (std::string &out, const " << name << " &object) {\n";
+  } else {
+    out << "void append_json (std::string &out, const " << name << " &object) {\n";
+  }
+  LiteralWriter literals (out);
+  literals.add ("{\"@type\":\"" + constructor->name + "\"");
+  for (auto &arg : constructor->args) {
+    auto field = "object." + gen_cpp_field_name (arg.name);
+    auto key = ",\"" + arg.name + "\":";
+    if (arg.type->type == Type::Custom) {
+      // null objects are omitted, as to_json does
+      literals.flush (1);
+      out << "  if (" << field << ") {\n";
+      out << "    append_literal (out, " << literal (key) << ");\n";
+      out << "    append_json (out, *" << field << ");\n";
+      out << "  }\n";
+    } else {
+      literals.add (key);
+      literals.flush (1);
+      gen_value (out, arg.type, field, 1, 0);
+    }
+  }
+  literals.add ("}");
+  literals.flush (1);
+  out << "}\n\n";
+  if (cache_kind != nullptr) {
+    gen_cached (out, name, cache_kind);
+  }
+}
+
+// writes the fields selected by projection only, with the output of
+// JsonProjection::store over the full JSON
+static void gen_projected_constructor (std::ostream &out, const Constructor *constructor) {
+  auto name = gen_cpp_name (constructor->name);
+  out << "void append_json (std::string &out, const " << name << " &object, const ::JsonProjection &projection) {\n"
+      << "  if (projection.keeps_all ()) {\n"
+      << "    append_json (out, object);\n"
+      << "    return;\n"
+      << "  }\n"
+      << "  append_literal (out, " << literal ("{\"@type\":\"" + constructor->name + "\"") << ");\n";
+  if (!constructor->args.empty ()) {
+    out << "  const ::JsonProjection *child;\n";
+  }
+  for (auto &arg : constructor->args) {
+    auto field = "object." + gen_cpp_field_name (arg.name);
+    auto condition = "(child = projection.get_child (" + literal (arg.name) + ")) != nullptr";
+    if (arg.type->type == Type::Custom) {
+      // null objects are omitted, as to_json does
+      out << "  if (" << field << " && " << condition << ") {\n";
+      out << "    append_literal (out, " << literal (",\"" + arg.name + "\":") << ");\n";
+      out << "    append_json (out, *" << field << ", *child);\n";
+    } else {
+      out << "  if (" << condition << ") {\n";
+      out << "    append_literal (out, " << literal (",\"" + arg.name + "\":") << ");\n";
+      gen_projected_value (out, arg.type, field, "*child", 2, 0);
+    }
+    out << "  }\n";
+  }
+  out << "  out += '}';\n"
+      << "}\n\n";
+}
+
+void gen_json_encoder (const Schema &schema, const std::string &file_name) {
+  std::ostringstream header;
+  header << "#pragma once\n\n"
+         << "// generated from td_api.tlo by generate_tdbot_api, do not edit\n\n"
+         << "#include \"auto/td/telegram/td_api.h\"\n\n"
+         << "#include <string>\n\n"
+         << "class JsonProjection;\n\n"
+         << "namespace td {\n"
+         << "namespace td_api {\n\n"
+         << "void append_json (std::string &out, const Object &object);\n"
+         << "void append_json (std::string &out, const Object &object, const ::JsonProjection &projection);\n";
+
+  std::ostringstream source;
+  source << "// generated from td_api.tlo by generate_tdbot_api, do not edit\n\n"
+         << "#include \"auto/td_api_json_fast.h\"\n\n"
+         << "#include \"auto/td/telegram/td_api.hpp\"\n\n"
+         << "#include \"clijson.hpp\"\n"
+         << "#include \"jsoncache.hpp\"\n\n"
+         << "#include \"td/tl/tl_json.h\"\n"
+         << "#include \"td/utils/base64.h\"\n"
+         << "#include \"td/utils/JsonBuilder.h\"\n\n"
+         << "#include <cstdint>\n\n"
+         << "namespace td {\n"
+         << "namespace td_api {\n\n"
+         << "template <size_t N>\n"
+         << "static void append_literal (std::string &out, const char (&s)[N]) {\n"
+         << "  out.append (s, N - 1);\n"
+         << "}\n\n"
+         << "static void append_integer (std::string &out, std::int64_t x) {\n"
+         << "  char buf[24];\n"
+         << "  char *end = buf + sizeof (buf);\n"
+         << "  char *p = end;\n"
+         << "  auto u = x < 0 ? 0 - static_cast<std::uint64_t>(x) : static_cast<std::uint64_t>(x);\n"
+         << "  do {\n"
+         << "    *--p = static_cast<char>('0' + u % 10);\n"
+         << "    u /= 10;\n"
+         << "  } while (u != 0);\n"
+         << "  if (x < 0) {\n"
+         << "    *--p = '-';\n"
+         << "  }\n"
+         << "  out.append (p, static_cast<size_t>(end - p));\n"
+         << "}\n\n"
+         << "// doubles are rare and their formatting must match to_json exactly\n"
+         << "static void append_double (std::string &out, double x) {\n"
+         << "  char buf[64];\n"
+         << "  JsonBuilder jb (StringBuilder (MutableSlice (buf, sizeof (buf))), -1);\n"
+         << "  jb.enter_value () << ToJson (x);\n"
+         << "  auto s = jb.string_builder ().as_cslice ();\n"
+         << "  out.append (s.data (), s.size ());\n"
+         << "}\n\n"
+         << "static void append_bool (std::string &out, bool x) {\n"
+         << "  if (x) {\n"
+         << "    append_literal (out, \"true\");\n"
+         << "  } else {\n"
+         << "    append_literal (out, \"false\");\n"
+         << "  }\n"
+         << "}\n\n"
+         << "static void append_bytes (std::string &out, const std::string &x) {\n"
+         << "  out += '\"';\n"
+         << "  out += base64_encode (x);\n"
+         << "  out += '\"';\n"
+         << "}\n\n";
+
+  for (auto *custom_type : schema.custom_types) {
+    if (custom_type->constructors.size () > 1) {
+      auto type_name = gen_cpp_name (custom_type->name);
+      header << "void append_json (std::string &out, const " << type_name << " &object);\n"
+             << "void append_json (std::string &out, const " << type_name << " &object, const ::JsonProjection &projection);\n";
+      source << "void append_json (std::string &out, const " << type_name << " &object) {\n"
+             << "  downcast_call (const_cast<" << type_name
+             << " &>(object), [&out](const auto &object) { append_json (out, object); });\n"
+             << "}\n\n"
+             << "void append_json (std::string &out, const " << type_name << " &object, const ::JsonProjection &projection) {\n"
+             << "  downcast_call (const_cast<" << type_name
+             << " &>(object), [&out, &projection](const auto &object) { append_json (out, object, projection); });\n"
+             << "}\n\n";
+    }
+    for (auto *constructor : custom_type->constructors) {
+      auto name = gen_cpp_name (constructor->name);
+      header << "void append_json (std::string &out, const " << name << " &object);\n"
+             << "void append_json (std::string &out, const " << name << " &object, const ::JsonProjection &projection);\n";
+      gen_constructor (source, constructor);
+      gen_projected_constructor (source, constructor);
+    }
+  }
+  header << "\n"
+         << "template <class T>\n"
+         << "void append_json (std::string &out, const object_ptr<T> &object) {\n"
+         << "  if (object) {\n"
+         << "    append_json (out, *object);\n"
+         << "  } else {\n"
+         << "    out += \"null\";\n"
+         << "  }\n"
+         << "}\n\n"
+         << "template <class T>\n"
+         << "void append_json (std::string &out, const object_ptr<T> &object, const ::JsonProjection &projection) {\n"
+         << "  if (object) {\n"
+         << "    append_json (out, *object, projection);\n"
+         << "  } else {\n"
+         << "    out += \"null\";\n"
+         << "  }\n"
+         << "}\n\n"
+         << "}  // namespace td_api\n"
+         << "}  // namespace td\n";
+  source << "void append_json (std::string &out, const Object &object) {\n"
+         << "  downcast_call (const_cast<Object &>(object), [&out](const auto &object) { append_json (out, object); });\n"
+         << "}\n\n"
+         << "void append_json (std::string &out, const Object &object, const ::JsonProjection &projection) {\n"
+         << "  downcast_call (const_cast<Object &>(object), [&out, &projection](const auto &object) { append_json (out, object, projection); });\n"
+         << "}\n\n"
+         << "}  // namespace td_api\n"
+         << "}  // namespace td\n";
+
+  std::ofstream (file_name + ".h") << header.str ();
+  std::ofstream (file_name + ".cpp") << source.str ();
+}
+
+}  // namespace tdbot
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "td/tl/tl_simple.h"
+
+#include <string>
+
+namespace tdbot {
+
+// generates append_json (std::string &, const td_api::T &) for every td_api
+// type, writing the same JSON as td_api_json's to_json, and an overload
+// taking a JsonProjection that writes only the selected fields
+void gen_json_encoder (const td::tl::simple::Schema &schema, const std::string &file_name);
+
+}  // namespace tdbot
@@ -0,0 +1,339 @@
+#include "tl_lua_builder.h"
+
+#include <fstream>
+#include <sstream>
+
+namespace tdbot {
+
+using td::tl::simple::Arg;
+using td::tl::simple::Constructor;
+using td::tl::simple::CustomType;
+using td::tl::simple::Schema;
+using td::tl::simple::Type;
+using td::tl::simple::gen_cpp_field_name;
+using td::tl::simple::gen_cpp_name;
+
+// name of the functor reading a value of TL type from the Lua stack
+static std::string gen_reader (const Type *type) {
+  switch (type->type) {
+    case Type::Bytes:
+    case Type::SecureBytes:
+      return "ReadBytes";
+    case Type::Vector:
+      return "ReadVector<" + gen_reader (type->vector_value_type) + ">";
+    default:
+      return "ReadValue";
+  }
+}
+
+static void gen_fields (std::ostream &out, const std::string &name, const std::vector<Arg> &args) {
+  out << "static Status read_fields (lua_State *L, int index, td_api::" << name << " &to, const LuaPath *path) {\n";
+  for (auto &arg : args) {
+    out << "  TRY_STATUS (read_field (L, index, \"" << arg.name << "\", to." << gen_cpp_field_name (arg.name)
+        << ", path, " << gen_reader (arg.type) << " ()));\n";
+  }
+  out << "  return Status::OK ();\n";
+  out << "}\n\n";
+}
+
+template <class T>
+static void gen_dispatch (std::ostream &out, const std::string &type_name, const std::vector<const T *> &constructors) {
+  out << "static Status read_value (lua_State *L, int index, td_api::object_ptr<td_api::" << type_name
+      << "> &to, const LuaPath *path) {\n";
+  out << "  std::int32_t id;\n";
+  out << "  TRY_STATUS (read_type_id (L, index, path, id));\n";
+  out << "  switch (id) {\n";
+  for (auto *constructor : constructors) {
+    auto name = gen_cpp_name (constructor->name);
+    out << "    case td_api::" << name << "::ID:\n";
+    out << "      return read_object<td_api::" << name << "> (L, index, to, path);\n";
+  }
+  out << "    default:\n";
+  out << "      return field_error (path, \"@type is not a " << type_name << "\");\n";
+  out << "  }\n";
+  out << "}\n\n";
+}
+
+void gen_lua_builder (const Schema &schema, const std::string &file_name) {
+  std::ostringstream header;
+  header << "#pragma once\n\n"
+         << "// generated from td_api.tlo by generate_tdbot_api, do not edit\n\n"
+         << "#include \"auto/td/telegram/td_api.h\"\n\n"
+         << "#include \"td/utils/Status.h\"\n\n"
+         << "#include <lua.hpp>\n\n"
+         << "namespace td {\n\n"
+         << "// reads the table at index into a function object; errors name the offending field\n"
+         << "Status from_lua (lua_State *L, int index, td_api::object_ptr<td_api::Function> &to);\n\n"
+         << "}  // namespace td\n";
+
+  std::vector<const CustomType *> types;
+  for (auto *custom_type : schema.custom_types) {
+    if (custom_type->is_query_) {
+      types.push_back (custom_type);
+    }
+  }
+
+  std::ostringstream source;
+  source << "// generated from td_api.tlo by generate_tdbot_api, do not edit\n\n"
+         << "#include \"auto/td_api_lua_builder.h\"\n\n"
+         << "#include \"auto/td/telegram/td_api.hpp\"\n\n"
+         << "#include \"td/utils/base64.h\"\n"
+         << "#include \"td/utils/misc.h\"\n\n"
+         << "#include <string>\n"
+         << "#include <unordered_map>\n\n"
+         << "namespace td {\n\n"
+         << "// position inside the table being read; only rendered when reporting an error\n"
+         << "struct LuaPath {\n"
+         << "  const LuaPath *parent;\n"
+         << "  const char *field;\n"
+         << "  int index;\n"
+         << "};\n\n"
+         << "static std::string path_to_string (const LuaPath *path) {\n"
+         << "  if (path == nullptr) {\n"
+         << "    return std::string ();\n"
+         << "  }\n"
+         << "  auto res = path_to_string (path->parent);\n"
+         << "  if (path->field == nullptr) {\n"
+         << "    res += \"[\" + std::to_string (path->index) + \"]\";\n"
+         << "  } else {\n"
+         << "    if (!res.empty ()) {\n"
+         << "      res += '.';\n"
+         << "    }\n"
+         << "    res += path->field;\n"
+         << "  }\n"
+         << "  return res;\n"
+         << "}\n\n"
+         << "static Status field_error (const LuaPath *path, const std::string &message) {\n"
+         << "  if (path == nullptr) {\n"
+         << "    return Status::Error (400, message);\n"
+         << "  }\n"
+         << "  return Status::Error (400, \"field \" + path_to_string (path) + \": \" + message);\n"
+         << "}\n\n"
+         << "static Status type_error (lua_State *L, int index, const LuaPath *path, const char *expected) {\n"
+         << "  return field_error (path, std::string (\"expected \") + expected + \", got \" + lua_typename (L, lua_type (L, index)));\n"
+         << "}\n\n"
+         << "static Status read_value (lua_State *L, int index, std::int64_t &to, const LuaPath *path) {\n"
+         << "  switch (lua_type (L, index)) {\n"
+         << "    case LUA_TNUMBER: {\n"
+         << "      auto x = lua_tonumber (L, index);\n"
+         << "      // also false for NaN; casting a double outside the range is undefined\n"
+         << "      if (!(x >= -9223372036854775808.0 && x < 9223372036854775808.0)) {\n"
+         << "        return field_error (path, \"integer out of int64 range\");\n"
+         << "      }\n"
+         << "      to = static_cast<std::int64_t>(x);\n"
+         << "      if (static_cast<double>(to) != x) {\n"
+         << "        return field_error (path, \"expected integer\");\n"
+         << "      }\n"
+         << "      return Status::OK ();\n"
+         << "    }\n"
+         << "    case LUA_TSTRING: {\n"
+         << "      size_t len;\n"
+         << "      auto s = lua_tolstring (L, index, &len);\n"
+         << "      auto r = to_integer_safe<std::int64_t> (Slice (s, len));\n"
+         << "      if (r.is_error ()) {\n"
+         << "        return field_error (path, \"expected integer\");\n"
+         << "      }\n"
+         << "      to = r.ok ();\n"
+         << "      return Status::OK ();\n"
+         << "    }\n"
+         << "    default:\n"
+         << "      return type_error (L, index, path, \"integer\");\n"
+         << "  }\n"
+         << "}\n\n"
+         << "static Status read_value (lua_State *L, int index, std::int32_t &to, const LuaPath *path) {\n"
+         << "  std::int64_t x;\n"
+         << "  TRY_STATUS (read_value (L, index, x, path));\n"
+         << "  if (x < -2147483648ll || x > 2147483647ll) {\n"
+         << "    return field_error (path, \"integer out of int32 range\");\n"
+         << "  }\n"
+         << "  to = static_cast<std::int32_t>(x);\n"
+         << "  return Status::OK ();\n"
+         << "}\n\n"
+         << "static Status read_value (lua_State *L, int index, double &to, const LuaPath *path) {\n"
+         << "  if (lua_type (L, index) == LUA_TSTRING) {\n"
+         << "    size_t len;\n"
+         << "    auto s = lua_tolstring (L, index, &len);\n"
+         << "    to = to_double (Slice (s, len));\n"
+         << "    return Status::OK ();\n"
+         << "  }\n"
+         << "  if (lua_type (L, index) != LUA_TNUMBER) {\n"
+         << "    return type_error (L, index, path, \"number\");\n"
+         << "  }\n"
+         << "  to = static_cast<double>(lua_tonumber (L, index));\n"
+         << "  return Status::OK ();\n"
+         << "}\n\n"
+         << "static Status read_value (lua_State *L, int index, bool &to, const LuaPath *path) {\n"
+         << "  switch (lua_type (L, index)) {\n"
+         << "    case LUA_TBOOLEAN:\n"
+         << "      to = lua_toboolean (L, index) != 0;\n"
+         << "      return Status::OK ();\n"
+         << "    case LUA_TNUMBER:\n"
+         << "      to = lua_tonumber (L, index) != 0;\n"
+         << "      return Status::OK ();\n"
+         << "    default:\n"
+         << "      return type_error (L, index, path, \"boolean\");\n"
+         << "  }\n"
+         << "}\n\n"
+         << "// numbers are accepted too, lua_tolstring converts them\n"
+         << "static Status read_value (lua_State *L, int index, std::string &to, const LuaPath *path) {\n"
+         << "  if (lua_type (L, index) != LUA_TSTRING && lua_type (L, index) != LUA_TNUMBER) {\n"
+         << "    return type_error (L, index, path, \"string\");\n"
+         << "  }\n"
+         << "  size_t len;\n"
+         << "  auto s = lua_tolstring (L, index, &len);\n"
+         << "  to.assign (s, len);\n"
+         << "  return Status::OK ();\n"
+         << "}\n\n"
+         << "static std::int32_t get_type_id (Slice name);\n\n"
+         << "static Status read_type_id (lua_State *L, int index, const LuaPath *path, std::int32_t &id) {\n"
+         << "  if (!lua_istable (L, index)) {\n"
+         << "    return type_error (L, index, path, \"object\");\n"
+         << "  }\n"
+         << "  lua_getfield (L, index, \"@type\");\n"
+         << "  if (lua_type (L, -1) != LUA_TSTRING) {\n"
+         << "    lua_pop (L, 1);\n"
+         << "    return field_error (path, \"missing @type\");\n"
+         << "  }\n"
+         << "  size_t len;\n"
+         << "  auto s = lua_tolstring (L, -1, &len);\n"
+         << "  Slice name (s, len);\n"
+         << "  id = get_type_id (name);\n"
+         << "  auto status = id == 0 ? field_error (path, \"unknown @type \" + name.str ()) : Status::OK ();\n"
+         << "  lua_pop (L, 1);\n"
+         << "  return status;\n"
+         << "}\n\n";
+
+  for (auto *custom_type : types) {
+    if (custom_type->constructors.size () > 1) {
+      source << "static Status read_value (lua_State *L, int index, td_api::object_ptr<td_api::"
+             << gen_cpp_name (custom_type->name) << "> &to, const LuaPath *path);\n";
+    }
+    for (auto *constructor : custom_type->constructors) {
+      auto name = gen_cpp_name (constructor->name);
+      if (custom_type->constructors.size () == 1) {
+        source << "static Status read_value (lua_State *L, int index, td_api::object_ptr<td_api::" << name
+               << "> &to, const LuaPath *path);\n";
+      }
+      source << "static Status read_fields (lua_State *L, int index, td_api::" << name << " &to, const LuaPath *path);\n";
+    }
+  }
+  for (auto *function : schema.functions) {
+    source << "static Status read_fields (lua_State *L, int index, td_api::" << gen_cpp_name (function->name)
+           << " &to, const LuaPath *path);\n";
+  }
+
+  source << "\n"
+         << "template <class T, class BaseT>\n"
+         << "static Status read_object (lua_State *L, int index, td_api::object_ptr<BaseT> &to, const LuaPath *path) {\n"
+         << "  auto object = td_api::make_object<T> ();\n"
+         << "  TRY_STATUS (read_fields (L, index, *object, path));\n"
+         << "  to = std::move (object);\n"
+         << "  return Status::OK ();\n"
+         << "}\n\n"
+         << "struct ReadValue {\n"
+         << "  template <class T>\n"
+         << "  Status operator() (lua_State *L, int index, T &to, const LuaPath *path) const {\n"
+         << "    return read_value (L, index, to, path);\n"
+         << "  }\n"
+         << "};\n\n"
+         << "struct ReadBytes {\n"
+         << "  Status operator() (lua_State *L, int index, std::string &to, const LuaPath *path) const {\n"
+         << "    if (lua_type (L, index) != LUA_TSTRING) {\n"
+         << "      return type_error (L, index, path, \"base64 string\");\n"
+         << "    }\n"
+         << "    size_t len;\n"
+         << "    auto s = lua_tolstring (L, index, &len);\n"
+         << "    auto r = base64_decode (Slice (s, len));\n"
+         << "    if (r.is_error ()) {\n"
+         << "      return field_error (path, \"invalid base64\");\n"
+         << "    }\n"
+         << "    to = r.move_as_ok ();\n"
+         << "    return Status::OK ();\n"
+         << "  }\n"
+         << "};\n\n"
+         << "// arrays are 0-based as tdbot pushes them; 1-based tables are accepted as well\n"
+         << "template <class ReadT>\n"
+         << "struct ReadVector {\n"
+         << "  template <class T>\n"
+         << "  Status operator() (lua_State *L, int index, std::vector<T> &to, const LuaPath *path) const {\n"
+         << "    if (!lua_istable (L, index)) {\n"
+         << "      return type_error (L, index, path, \"array\");\n"
+         << "    }\n"
+         << "    lua_rawgeti (L, index, 0);\n"
+         << "    int first = lua_isnil (L, -1) ? 1 : 0;\n"
+         << "    lua_pop (L, 1);\n"
+         << "    to.clear ();\n"
+         << "    for (int i = first;; i++) {\n"
+         << "      lua_rawgeti (L, index, i);\n"
+         << "      if (lua_isnil (L, -1)) {\n"
+         << "        lua_pop (L, 1);\n"
+         << "        return Status::OK ();\n"
+         << "      }\n"
+         << "      LuaPath element{path, nullptr, i - first};\n"
+         << "      T value{};\n"
+         << "      auto status = ReadT () (L, lua_gettop (L), value, &element);\n"
+         << "      lua_pop (L, 1);\n"
+         << "      TRY_STATUS (status);\n"
+         << "      to.push_back (std::move (value));\n"
+         << "    }\n"
+         << "  }\n"
+         << "};\n\n"
+         << "// missing and nil fields keep their default value, as from_json does\n"
+         << "template <class T, class ReadT>\n"
+         << "static Status read_field (lua_State *L, int index, const char *name, T &to, const LuaPath *path, ReadT read) {\n"
+         << "  lua_getfield (L, index, name);\n"
+         << "  LuaPath field{path, name, 0};\n"
+         << "  auto status = lua_isnil (L, -1) ? Status::OK () : read (L, lua_gettop (L), to, &field);\n"
+         << "  lua_pop (L, 1);\n"
+         << "  return status;\n"
+         << "}\n\n";
+
+  for (auto *custom_type : types) {
+    if (custom_type->constructors.size () > 1) {
+      gen_dispatch (source, gen_cpp_name (custom_type->name), custom_type->constructors);
+    } else {
+      auto name = gen_cpp_name (custom_type->constructors[0]->name);
+      source << "static Status read_value (lua_State *L, int index, td_api::object_ptr<td_api::" << name
+             << "> &to, const LuaPath *path) {\n"
+             << "  if (!lua_istable (L, index)) {\n"
+             << "    return type_error (L, index, path, \"object\");\n"
+             << "  }\n"
+             << "  return read_object<td_api::" << name << "> (L, index, to, path);\n"
+             << "}\n\n";
+    }
+    for (auto *constructor : custom_type->constructors) {
+      gen_fields (source, gen_cpp_name (constructor->name), constructor->args);
+    }
+  }
+  for (auto *function : schema.functions) {
+    gen_fields (source, gen_cpp_name (function->name), function->args);
+  }
+  gen_dispatch (source, "Function", schema.functions);
+
+  source << "static std::int32_t get_type_id (Slice name) {\n"
+         << "  static const std::unordered_map<std::string, std::int32_t> ids = {\n";
+  for (auto *custom_type : types) {
+    for (auto *constructor : custom_type->constructors) {
+      source << "    {\"" << constructor->name << "\", td_api::" << gen_cpp_name (constructor->name) << "::ID},\n";
+    }
+  }
+  for (auto *function : schema.functions) {
+    source << "    {\"" << function->name << "\", td_api::" << gen_cpp_name (function->name) << "::ID},\n";
+  }
+  source << "  };\n"
+         << "  auto it = ids.find (name.str ());\n"
+         << "  return it == ids.end () ? 0 : it->second;\n"
+         << "}\n\n"
+         << "Status from_lua (lua_State *L, int index, td_api::object_ptr<td_api::Function> &to) {\n"
+         << "  if (index < 0) {\n"
+         << "    index += lua_gettop (L) + 1;\n"
+         << "  }\n"
+         << "  return read_value (L, index, to, nullptr);\n"
+         << "}\n\n"
+         << "}  // namespace td\n";
+
+  std::ofstream (file_name + ".h") << header.str ();
+  std::ofstream (file_name + ".cpp") << source.str ();
+}
+
+}  // namespace tdbot
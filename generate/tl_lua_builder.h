@@ -0,0 +1,13 @@
+#pragma once
+
+#include "td/tl/tl_simple.h"
+
+#include <string>
+
+namespace tdbot {
+
+// generates from_lua (lua_State *, int, td_api::object_ptr<td_api::Function> &),
+// which reads a Lua table straight into a td_api function object
+void gen_lua_builder (const td::tl::simple::Schema &schema, const std::string &file_name);
+
+}  // namespace tdbot
@@ -0,0 +1,342 @@
+#include "tl_lua_converter.h"
+
+#include <fstream>
+#include <sstream>
+
+namespace tdbot {
+
+using td::tl::simple::Constructor;
+using td::tl::simple::CustomType;
+using td::tl::simple::Schema;
+using td::tl::simple::Type;
+using td::tl::simple::gen_cpp_field_name;
+using td::tl::simple::gen_cpp_name;
+
+static std::string indent (int depth) {
+  return std::string (2 * depth, ' ');
+}
+
+// emits code pushing expr of TL type onto the Lua stack
+static void gen_push (std::ostream &out, const Type *type, const std::string &expr, int depth, int level) {
+  auto ind = indent (depth);
+  switch (type->type) {
+    case Type::Int32:
+      out << ind << "lua_pushnumber (L, " << expr << ");\n";
+      break;
+    case Type::Int53:
+      out << ind << "push_int53 (L, " << expr << ");\n";
+      break;
+    case Type::Int64:
+      out << ind << "push_int64 (L, " << expr << ");\n";
+      break;
+    case Type::Double:
+      out << ind << "lua_pushnumber (L, " << expr << ");\n";
+      break;
+    case Type::Bool:
+      out << ind << "lua_pushboolean (L, " << expr << ");\n";
+      break;
+    case Type::String:
+    case Type::SecureString:
+      out << ind << "lua_pushlstring (L, " << expr << ".data (), " << expr << ".size ());\n";
+      break;
+    case Type::Bytes:
+    case Type::SecureBytes:
+      out << ind << "push_bytes (L, " << expr << ");\n";
+      break;
+    case Type::Vector: {
+      auto v = "v" + std::to_string (level);
+      auto i = "i" + std::to_string (level);
+      out << ind << "{\n";
+      out << ind << "  auto &" << v << " = " << expr << ";\n";
+      out << ind << "  lua_createtable (L, static_cast<int>(" << v << ".size ()), 1);\n";
+      out << ind << "  for (size_t " << i << " = 0; " << i << " < " << v << ".size (); " << i << "++) {\n";
+      out << ind << "    lua_pushinteger (L, static_cast<lua_Integer>(" << i << "));\n";
+      gen_push (out, type->vector_value_type, v + "[" + i + "]", depth + 2, level + 1);
+      out << ind << "    lua_settable (L, -3);\n";
+      out << ind << "  }\n";
+      out << ind << "}\n";
+      break;
+    }
+    case Type::Custom:
+      out << ind << "if (" << expr << ") {\n";
+      out << ind << "  to_lua (L, *" << expr << ");\n";
+      out << ind << "} else {\n";
+      out << ind << "  lua_pushnil (L);\n";
+      out << ind << "}\n";
+      break;
+    default:
+      out << ind << "lua_pushnil (L);\n";
+      break;
+  }
+}
+
+static void gen_constructor (std::ostream &out, const Constructor *constructor) {
+  auto name = gen_cpp_name (constructor->name);
+  out << "void to_lua (lua_State *L, const td_api::" << name << " &object) {\n";
+  out << "  lua_createtable (L, 0, " << constructor->args.size () + 1 << ");\n";
+  out << "  lua_pushliteral (L, \"" << constructor->name << "\");\n";
+  out << "  lua_setfield (L, -2, \"@type\");\n";
+  for (auto &arg : constructor->args) {
+    auto field = "object." + gen_cpp_field_name (arg.name);
+    if (arg.type->type == Type::Custom) {
+      // null objects are omitted, as ToJson does
+      out << "  if (" << field << ") {\n";
+      out << "    to_lua (L, *" << field << ");\n";
+      out << "    lua_setfield (L, -2, \"" << arg.name << "\");\n";
+      out << "  }\n";
+    } else {
+      gen_push (out, arg.type, field, 1, 0);
+      out << "  lua_setfield (L, -2, \"" << arg.name << "\");\n";
+    }
+  }
+  out << "}\n\n";
+}
+
+// emits the lazy proxy accessors of a constructor: the list of its keys and a
+// function pushing the value of one of them
+static void gen_proxy_constructor (std::ostream &out, const Constructor *constructor) {
+  auto name = gen_cpp_name (constructor->name);
+  out << "static const char *const proxy_keys_" << name << "[] = {\"@type\", ";
+  for (auto &arg : constructor->args) {
+    out << "\"" << arg.name << "\", ";
+  }
+  out << "nullptr};\n\n";
+  out << "static const char *const *proxy_keys (const td_api::" << name << " &object) {\n"
+      << "  return proxy_keys_" << name << ";\n"
+      << "}\n\n";
+
+  out << "static bool proxy_index (lua_State *L, const LuaProxy &proxy, const td_api::" << name
+      << " &object, const char *key) {\n";
+  out << "  if (std::strcmp (key, \"@type\") == 0) {\n";
+  out << "    lua_pushliteral (L, \"" << constructor->name << "\");\n";
+  out << "    return true;\n";
+  out << "  }\n";
+  for (auto &arg : constructor->args) {
+    auto field = "object." + gen_cpp_field_name (arg.name);
+    out << "  if (std::strcmp (key, \"" << arg.name << "\") == 0) {\n";
+    if (arg.type->type == Type::Custom) {
+      out << "    if (" << field << ") {\n";
+      out << "      push_lua_proxy (L, proxy.root, *" << field << ");\n";
+      out << "    } else {\n";
+      out << "      lua_pushnil (L);\n";
+      out << "    }\n";
+    } else {
+      gen_push (out, arg.type, field, 2, 0);
+    }
+    out << "    return true;\n";
+    out << "  }\n";
+  }
+  out << "  return false;\n";
+  out << "}\n\n";
+}
+
+static const char *proxy_source = R"(static LuaProxy *check_proxy (lua_State *L, int index) {
+  return static_cast<LuaProxy *>(luaL_checkudata (L, index, LUA_PROXY_METATABLE));
+}
+
+// pushes the value of key, or returns false if the object has no such field
+static bool push_proxy_field (lua_State *L, const LuaProxy &proxy, const char *key) {
+  bool found = false;
+  td_api::downcast_call (const_cast<td_api::Object &>(*proxy.object),
+                         [&](const auto &object) { found = proxy_index (L, proxy, object, key); });
+  return found;
+}
+
+// like push_proxy_field, but a field is built only on its first read and kept
+// in the proxy's cache table, so later reads neither allocate nor return a
+// different proxy
+static bool push_cached_proxy_field (lua_State *L, LuaProxy &proxy, const char *key) {
+  if (proxy.cache == LUA_NOREF) {
+    lua_newtable (L);
+    proxy.cache = luaL_ref (L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti (L, LUA_REGISTRYINDEX, proxy.cache);
+  lua_getfield (L, -1, key);
+  if (!lua_isnil (L, -1)) {
+    lua_remove (L, -2);
+    return true;
+  }
+  lua_pop (L, 1);
+  if (!push_proxy_field (L, proxy, key)) {
+    lua_pop (L, 1);
+    return false;
+  }
+  if (!lua_isnil (L, -1)) {
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -3, key);
+  }
+  lua_remove (L, -2);
+  return true;
+}
+
+static int proxy_index_meta (lua_State *L) {
+  auto proxy = check_proxy (L, 1);
+  auto key = lua_type (L, 2) == LUA_TSTRING ? lua_tostring (L, 2) : nullptr;
+  if (key == nullptr || !push_cached_proxy_field (L, *proxy, key)) {
+    lua_pushnil (L);
+  }
+  return 1;
+}
+
+// iterator for __pairs; null objects are skipped, as to_lua omits them
+static int proxy_next (lua_State *L) {
+  auto proxy = check_proxy (L, 1);
+  const char *const *keys = nullptr;
+  td_api::downcast_call (const_cast<td_api::Object &>(*proxy->object),
+                         [&](const auto &object) { keys = proxy_keys (object); });
+  if (keys == nullptr) {
+    return 0;
+  }
+  size_t i = 0;
+  if (!lua_isnil (L, 2)) {
+    auto key = lua_tostring (L, 2);
+    while (keys[i] != nullptr && (key == nullptr || std::strcmp (keys[i], key) != 0)) {
+      i++;
+    }
+    if (keys[i] == nullptr) {
+      return 0;
+    }
+    i++;
+  }
+  for (; keys[i] != nullptr; i++) {
+    lua_pushstring (L, keys[i]);
+    if (!push_cached_proxy_field (L, *proxy, keys[i])) {
+      lua_pushnil (L);
+    }
+    if (!lua_isnil (L, -1)) {
+      return 2;
+    }
+    lua_pop (L, 2);
+  }
+  return 0;
+}
+
+static int proxy_pairs_meta (lua_State *L) {
+  check_proxy (L, 1);
+  lua_pushcfunction (L, proxy_next);
+  lua_pushvalue (L, 1);
+  lua_pushnil (L);
+  return 3;
+}
+
+static int proxy_gc_meta (lua_State *L) {
+  auto proxy = check_proxy (L, 1);
+  luaL_unref (L, LUA_REGISTRYINDEX, proxy->cache);
+  proxy->~LuaProxy ();
+  return 0;
+}
+
+static int proxy_tostring_meta (lua_State *L) {
+  auto s = td_api::to_string (*check_proxy (L, 1)->object);
+  lua_pushlstring (L, s.data (), s.size ());
+  return 1;
+}
+
+void push_lua_proxy (lua_State *L, std::shared_ptr<const td_api::Object> root, const td_api::Object &object) {
+  auto memory = lua_newuserdata (L, sizeof (LuaProxy));
+  new (memory) LuaProxy{std::move (root), &object, LUA_NOREF};
+  if (luaL_newmetatable (L, LUA_PROXY_METATABLE)) {
+    lua_pushcfunction (L, proxy_index_meta);
+    lua_setfield (L, -2, "__index");
+    lua_pushcfunction (L, proxy_pairs_meta);
+    lua_setfield (L, -2, "__pairs");
+    lua_pushcfunction (L, proxy_gc_meta);
+    lua_setfield (L, -2, "__gc");
+    lua_pushcfunction (L, proxy_tostring_meta);
+    lua_setfield (L, -2, "__tostring");
+  }
+  lua_setmetatable (L, -2);
+}
+
+const td_api::Object *get_lua_proxy (lua_State *L, int index) {
+  if (!lua_isuserdata (L, index) || !lua_getmetatable (L, index)) {
+    return nullptr;
+  }
+  luaL_getmetatable (L, LUA_PROXY_METATABLE);
+  bool is_proxy = lua_rawequal (L, -1, -2) != 0;
+  lua_pop (L, 2);
+  return is_proxy ? static_cast<LuaProxy *>(lua_touserdata (L, index))->object : nullptr;
+}
+
+)";
+
+void gen_lua_converter (const Schema &schema, const std::string &file_name) {
+  std::ostringstream header;
+  header << "#pragma once\n\n"
+         << "// generated from td_api.tlo by generate_tdbot_api, do not edit\n\n"
+         << "#include \"auto/td/telegram/td_api.h\"\n\n"
+         << "#include <lua.hpp>\n\n"
+         << "#include <memory>\n\n"
+         << "#define LUA_PROXY_METATABLE \"tdbot.proxy\"\n\n"
+         << "namespace td {\n\n"
+         << "// lazy view of a td_api object: a userdata whose fields are pushed when\n"
+         << "// they are read; every proxy keeps the root object alive\n"
+         << "struct LuaProxy {\n"
+         << "  std::shared_ptr<const td_api::Object> root;\n"
+         << "  const td_api::Object *object;\n"
+         << "  // registry reference to the table of fields read so far, or LUA_NOREF\n"
+         << "  int cache;\n"
+         << "};\n\n"
+         << "void push_lua_proxy (lua_State *L, std::shared_ptr<const td_api::Object> root, const td_api::Object &object);\n"
+         << "// returns the object behind the proxy at index, or nullptr if it is not one\n"
+         << "const td_api::Object *get_lua_proxy (lua_State *L, int index);\n\n"
+         << "void to_lua (lua_State *L, const td_api::Object &object);\n";
+
+  std::ostringstream source;
+  source << "// generated from td_api.tlo by generate_tdbot_api, do not edit\n\n"
+         << "#include \"auto/td_api_lua.h\"\n\n"
+         << "#include \"auto/td/telegram/td_api.hpp\"\n\n"
+         << "#include \"td/utils/base64.h\"\n\n"
+         << "#include <cstring>\n"
+         << "#include <new>\n"
+         << "#include <string>\n\n"
+         << "namespace td {\n\n"
+         << "// values that do not fit into int are passed as strings, like the JSON path did\n"
+         << "static void push_int53 (lua_State *L, std::int64_t value) {\n"
+         << "  if (value == static_cast<int>(value)) {\n"
+         << "    lua_pushnumber (L, static_cast<int>(value));\n"
+         << "  } else {\n"
+         << "    auto s = std::to_string (value);\n"
+         << "    lua_pushlstring (L, s.data (), s.size ());\n"
+         << "  }\n"
+         << "}\n\n"
+         << "static void push_int64 (lua_State *L, std::int64_t value) {\n"
+         << "  auto s = std::to_string (value);\n"
+         << "  lua_pushlstring (L, s.data (), s.size ());\n"
+         << "}\n\n"
+         << "static void push_bytes (lua_State *L, const std::string &value) {\n"
+         << "  auto s = base64_encode (value);\n"
+         << "  lua_pushlstring (L, s.data (), s.size ());\n"
+         << "}\n\n";
+
+  for (auto *custom_type : schema.custom_types) {
+    if (custom_type->constructors.size () > 1) {
+      auto type_name = gen_cpp_name (custom_type->name);
+      header << "void to_lua (lua_State *L, const td_api::" << type_name << " &object);\n";
+      source << "void to_lua (lua_State *L, const td_api::" << type_name << " &object) {\n"
+             << "  td_api::downcast_call (const_cast<td_api::" << type_name
+             << " &>(object), [L](const auto &object) { to_lua (L, object); });\n"
+             << "}\n\n";
+    }
+    for (auto *constructor : custom_type->constructors) {
+      header << "void to_lua (lua_State *L, const td_api::" << gen_cpp_name (constructor->name) << " &object);\n";
+      gen_constructor (source, constructor);
+    }
+  }
+  source << "void to_lua (lua_State *L, const td_api::Object &object) {\n"
+         << "  td_api::downcast_call (const_cast<td_api::Object &>(object), [L](const auto &object) { to_lua (L, object); });\n"
+         << "}\n\n";
+  for (auto *custom_type : schema.custom_types) {
+    for (auto *constructor : custom_type->constructors) {
+      gen_proxy_constructor (source, constructor);
+    }
+  }
+  source << proxy_source
+         << "}  // namespace td\n";
+  header << "\n}  // namespace td\n";
+
+  std::ofstream (file_name + ".h") << header.str ();
+  std::ofstream (file_name + ".cpp") << source.str ();
+}
+
+}  // namespace tdbot
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "td/tl/tl_simple.h"
+
+#include <string>
+
+namespace tdbot {
+
+// generates to_lua (lua_State *, const td_api::T &) for every td_api type;
+// the pushed tables are the ones the JSON path used to produce. Also
+// generates push_lua_proxy, which pushes a lazy userdata view instead.
+void gen_lua_converter (const td::tl::simple::Schema &schema, const std::string &file_name);
+
+}  // namespace tdbot
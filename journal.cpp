@@ -0,0 +1,383 @@
+#include "journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "td/utils/crypto.h"
+#include "td/utils/logging.h"
+#include "td/utils/misc.h"
+
+constexpr size_t Journal::SEGMENT_SIZE;
+constexpr size_t Journal::HEADER_SIZE;
+
+Journal::~Journal () {
+  commit ();
+  for (auto &segment : segments_) {
+    unmap_segment (segment);
+  }
+}
+
+td::Status Journal::map_segment (Segment &segment, bool create) {
+  segment.fd = ::open (segment.path.c_str (), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+  if (segment.fd < 0) {
+    return td::Status::PosixError (errno, "can not open journal segment " + segment.path);
+  }
+  if (create) {
+    // the blocks must exist before the mapping is written, as a store into
+    // a hole of a full disk raises SIGBUS
+    auto err = posix_fallocate (segment.fd, 0, static_cast<off_t>(segment.capacity));
+    if (err != 0) {
+      return td::Status::PosixError (err, "can not allocate journal segment " + segment.path);
+    }
+  } else {
+    struct stat st;
+    if (fstat (segment.fd, &st) < 0) {
+      return td::Status::PosixError (errno, "can not stat journal segment " + segment.path);
+    }
+    segment.capacity = static_cast<size_t>(st.st_size);
+  }
+  void *data = mmap (nullptr, segment.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+  if (data == MAP_FAILED) {
+    return td::Status::PosixError (errno, "can not map journal segment " + segment.path);
+  }
+  segment.data = static_cast<char *>(data);
+  return td::Status::OK ();
+}
+
+void Journal::unmap_segment (Segment &segment) {
+  if (segment.data) {
+    munmap (segment.data, segment.capacity);
+    segment.data = nullptr;
+  }
+  if (segment.fd >= 0) {
+    ::close (segment.fd);
+    segment.fd = -1;
+  }
+}
+
+// record: 4-byte length, 4-byte CRC32 of the rest, 8-byte sequence number,
+// payload; a zero length marks the end of the written part of a segment.
+// After a crash of the OS any page may be lost, so the scan also stops at
+// a record that fails its CRC or does not continue the sequence.
+void Journal::scan_segment (Segment &segment) {
+  size_t pos = 0;
+  td::uint64 prev_seq = 0;
+  while (pos + HEADER_SIZE <= segment.capacity) {
+    td::uint32 len;
+    td::uint32 crc;
+    td::uint64 seq;
+    std::memcpy (&len, segment.data + pos, 4);
+    std::memcpy (&crc, segment.data + pos + 4, 4);
+    std::memcpy (&seq, segment.data + pos + 8, 8);
+    if (len == 0 || pos + HEADER_SIZE + len > segment.capacity || seq <= prev_seq) {
+      break;
+    }
+    if (td::crc32 (td::Slice (segment.data + pos + 8, 8 + len)) != crc) {
+      LOG(ERROR) << "journal segment " << segment.path << " has a damaged record at " << pos;
+      break;
+    }
+    segment.last_seq = seq;
+    prev_seq = seq;
+    pos += HEADER_SIZE + len;
+  }
+  segment.size = pos;
+}
+
+td::Status Journal::open () {
+  mkdir (dir_.c_str (), 0700);
+
+  DIR *d = opendir (dir_.c_str ());
+  if (!d) {
+    return td::Status::PosixError (errno, "can not open journal directory " + dir_);
+  }
+  std::vector<td::uint64> first_seqs;
+  while (auto entry = readdir (d)) {
+    td::Slice name (entry->d_name, std::strlen (entry->d_name));
+    if (name.size () > 4 && name.substr (name.size () - 4) == ".seg") {
+      first_seqs.push_back (td::to_integer<td::uint64>(name.substr (0, name.size () - 4)));
+    }
+  }
+  closedir (d);
+  std::sort (first_seqs.begin (), first_seqs.end ());
+
+  for (auto first_seq : first_seqs) {
+    Segment segment;
+    segment.first_seq = first_seq;
+    segment.path = dir_ + "/" + std::to_string (first_seq) + ".seg";
+    auto status = map_segment (segment, false);
+    if (status.is_error ()) {
+      return status;
+    }
+    scan_segment (segment);
+    if (segment.last_seq != 0) {
+      last_seq_ = segment.last_seq;
+    }
+    segments_.push_back (std::move (segment));
+  }
+  for (size_t i = 0; i + 1 < segments_.size (); i++) {
+    unmap_segment (segments_[i]);
+  }
+  if (!segments_.empty ()) {
+    // whatever follows the valid records is left from before a crash;
+    // clearing it keeps new records from lining up with stale ones
+    auto &last = segments_.back ();
+    std::memset (last.data + last.size, 0, last.capacity - last.size);
+    if (msync (last.data, last.capacity, MS_SYNC) < 0) {
+      LOG(ERROR) << "journal msync failed: " << std::strerror (errno);
+    }
+    synced_ = last.size;
+  }
+
+  load_offsets ();
+  LOG(INFO) << "journal " << dir_ << " opened with " << segments_.size () << " segments, last seq " << last_seq_;
+  return td::Status::OK ();
+}
+
+td::Status Journal::roll (td::uint64 seq, size_t need) {
+  commit ();
+  if (!segments_.empty ()) {
+    auto &last = segments_.back ();
+    unmap_segment (last);
+  }
+
+  Segment segment;
+  segment.first_seq = seq;
+  segment.path = dir_ + "/" + std::to_string (seq) + ".seg";
+  segment.capacity = std::max (SEGMENT_SIZE, need + HEADER_SIZE);
+  auto status = map_segment (segment, true);
+  if (status.is_error ()) {
+    bool created = segment.fd >= 0;
+    unmap_segment (segment);
+    if (created) {
+      unlink (segment.path.c_str ());
+    }
+    return status;
+  }
+  segments_.push_back (std::move (segment));
+  synced_ = 0;
+  truncate ();
+  return td::Status::OK ();
+}
+
+void Journal::append (td::uint64 seq, td::Slice update) {
+  if (disabled_) {
+    return;
+  }
+  size_t need = HEADER_SIZE + update.size ();
+  if (segments_.empty () || !segments_.back ().data || segments_.back ().size + need > segments_.back ().capacity) {
+    auto status = roll (seq, need);
+    if (status.is_error ()) {
+      LOG(ERROR) << "journal " << dir_ << " disabled: " << status;
+      disabled_ = true;
+      return;
+    }
+  }
+  auto &segment = segments_.back ();
+  auto len = static_cast<td::uint32>(update.size ());
+  auto pos = segment.data + segment.size;
+  std::memcpy (pos + 8, &seq, 8);
+  std::memcpy (pos + HEADER_SIZE, update.begin (), update.size ());
+  auto crc = td::crc32 (td::Slice (pos + 8, 8 + update.size ()));
+  std::memcpy (pos + 4, &crc, 4);
+  // the length goes last, so a record cut short by a crash of the process
+  // reads as the end of the segment
+  std::memcpy (pos, &len, 4);
+
+  segment.size += need;
+  segment.last_seq = seq;
+  last_seq_ = seq;
+}
+
+void Journal::commit () {
+  if (!segments_.empty ()) {
+    auto &segment = segments_.back ();
+    if (segment.data && segment.size > synced_) {
+      auto page = static_cast<size_t>(sysconf (_SC_PAGESIZE));
+      auto begin = synced_ / page * page;
+      if (msync (segment.data + begin, segment.size - begin, MS_SYNC) < 0) {
+        LOG(ERROR) << "journal msync failed: " << std::strerror (errno);
+      }
+      synced_ = segment.size;
+    }
+  }
+  if (offsets_dirty_) {
+    save_offsets ();
+    truncate ();
+  }
+}
+
+void Journal::replay (td::uint64 seq, const std::function<void (td::uint64, td::Slice)> &f) const {
+  for (auto &segment : segments_) {
+    if (segment.last_seq <= seq) {
+      continue;
+    }
+    const char *data = segment.data;
+    int fd = -1;
+    void *mapping = nullptr;
+    if (!data) {
+      fd = ::open (segment.path.c_str (), O_RDONLY);
+      if (fd < 0) {
+        LOG(ERROR) << "can not open journal segment " << segment.path;
+        continue;
+      }
+      mapping = mmap (nullptr, segment.capacity, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED) {
+        LOG(ERROR) << "can not map journal segment " << segment.path;
+        ::close (fd);
+        continue;
+      }
+      data = static_cast<const char *>(mapping);
+    }
+
+    size_t pos = 0;
+    while (pos + HEADER_SIZE <= segment.size) {
+      td::uint32 len;
+      td::uint64 record_seq;
+      std::memcpy (&len, data + pos, 4);
+      std::memcpy (&record_seq, data + pos + 8, 8);
+      if (record_seq > seq) {
+        f (record_seq, td::Slice (data + pos + HEADER_SIZE, len));
+      }
+      pos += HEADER_SIZE + len;
+    }
+
+    if (mapping) {
+      munmap (mapping, segment.capacity);
+      ::close (fd);
+    }
+  }
+}
+
+td::uint64 Journal::add_consumer (const std::string &name) {
+  auto it = offsets_.find (name);
+  if (it != offsets_.end ()) {
+    return it->second;
+  }
+  offsets_[name] = 0;
+  offsets_dirty_ = true;
+  return 0;
+}
+
+void Journal::ack (const std::string &name, td::uint64 seq) {
+  auto &offset = offsets_[name];
+  if (seq > offset) {
+    offset = std::min (seq, last_seq_);
+    offsets_dirty_ = true;
+  }
+}
+
+bool Journal::is_valid_consumer_name (td::Slice name) {
+  if (name.empty ()) {
+    return false;
+  }
+  for (auto c : name) {
+    if (!(('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || c == '_' || c == '.' || c == '-')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Journal::load_offsets () {
+  std::ifstream in (dir_ + "/offsets");
+  std::string name;
+  td::uint64 seq;
+  while (in >> name >> seq) {
+    if (is_valid_consumer_name (name)) {
+      offsets_[name] = seq;
+    }
+  }
+}
+
+static bool write_all (int fd, const std::string &data) {
+  size_t pos = 0;
+  while (pos < data.size ()) {
+    auto r = ::write (fd, data.data () + pos, data.size () - pos);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    pos += static_cast<size_t>(r);
+  }
+  return true;
+}
+
+// the new file is synced before the rename and the directory after it, so
+// an acknowledged offset survives a power failure
+void Journal::save_offsets () {
+  auto path = dir_ + "/offsets";
+  auto tmp_path = path + ".tmp";
+  std::string data;
+  for (auto &it : offsets_) {
+    data += it.first + " " + std::to_string (it.second) + "\n";
+  }
+
+  int fd = ::open (tmp_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    LOG(ERROR) << "can not open " << tmp_path << ": " << std::strerror (errno);
+    return;
+  }
+  bool ok = write_all (fd, data) && fsync (fd) == 0;
+  if (!ok) {
+    LOG(ERROR) << "can not write journal offsets to " << tmp_path << ": " << std::strerror (errno);
+  }
+  ::close (fd);
+  if (!ok) {
+    return;
+  }
+  if (std::rename (tmp_path.c_str (), path.c_str ()) < 0) {
+    LOG(ERROR) << "can not rename journal offsets: " << std::strerror (errno);
+    return;
+  }
+  int dir_fd = ::open (dir_.c_str (), O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0 || fsync (dir_fd) < 0) {
+    LOG(ERROR) << "can not sync journal directory " << dir_ << ": " << std::strerror (errno);
+  }
+  if (dir_fd >= 0) {
+    ::close (dir_fd);
+  }
+  offsets_dirty_ = false;
+}
+
+void Journal::remove_first_segment () {
+  auto &segment = segments_.front ();
+  unmap_segment (segment);
+  if (unlink (segment.path.c_str ()) < 0) {
+    LOG(ERROR) << "can not remove journal segment " << segment.path << ": " << std::strerror (errno);
+  }
+  segments_.erase (segments_.begin ());
+}
+
+// the last segment is never removed, it is the one being appended to
+void Journal::truncate () {
+  if (!offsets_.empty ()) {
+    td::uint64 min_offset = offsets_.begin ()->second;
+    for (auto &it : offsets_) {
+      min_offset = std::min (min_offset, it.second);
+    }
+    while (segments_.size () > 1 && segments_.front ().last_seq <= min_offset) {
+      remove_first_segment ();
+    }
+  }
+
+  size_t total = 0;
+  for (auto &segment : segments_) {
+    total += segment.capacity;
+  }
+  while (segments_.size () > 1 && total > max_size_) {
+    LOG(INFO) << "journal over " << max_size_ << " bytes, dropping " << segments_.front ().path;
+    total -= segments_.front ().capacity;
+    remove_first_segment ();
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "td/utils/common.h"
+#include "td/utils/Slice.h"
+#include "td/utils/Status.h"
+
+// Append-only journal of encoded updates, split into memory-mapped segment
+// files named after the sequence number of their first record. Appends only
+// touch the mapping; commit () syncs everything appended since the previous
+// commit at once, persists consumer offsets and removes segments that every
+// consumer has acknowledged.
+class Journal {
+  public:
+    // segments are removed once every consumer has acknowledged them, or
+    // oldest first once all of them together take more than max_size bytes,
+    // whether or not consumers have read them
+    Journal (std::string dir, size_t max_size) : dir_ (std::move (dir)), max_size_ (max_size) {
+    }
+    Journal (const Journal &) = delete;
+    Journal &operator= (const Journal &) = delete;
+    ~Journal ();
+
+    td::Status open ();
+
+    void append (td::uint64 seq, td::Slice update);
+    void commit ();
+
+    // calls f for every journaled update with sequence number greater than seq
+    void replay (td::uint64 seq, const std::function<void (td::uint64, td::Slice)> &f) const;
+
+    td::uint64 last_seq () const {
+      return last_seq_;
+    }
+
+    // names are stored in a text file, so they are limited to [A-Za-z0-9_.-]
+    static bool is_valid_consumer_name (td::Slice name);
+
+    // returns the acknowledged offset of the consumer, registering it if needed
+    td::uint64 add_consumer (const std::string &name);
+    void ack (const std::string &name, td::uint64 seq);
+
+  private:
+    static constexpr size_t SEGMENT_SIZE = 64 << 20;
+    static constexpr size_t HEADER_SIZE = 16;
+
+    struct Segment {
+      td::uint64 first_seq = 0;
+      td::uint64 last_seq = 0;
+      std::string path;
+      int fd = -1;
+      char *data = nullptr;
+      size_t capacity = 0;
+      size_t size = 0;
+    };
+
+    td::Status map_segment (Segment &segment, bool create);
+    void unmap_segment (Segment &segment);
+    void scan_segment (Segment &segment);
+    td::Status roll (td::uint64 seq, size_t need);
+    void save_offsets ();
+    void load_offsets ();
+    void remove_first_segment ();
+    void truncate ();
+
+    std::string dir_;
+    size_t max_size_;
+    std::vector<Segment> segments_;
+    td::uint64 last_seq_ = 0;
+    size_t synced_ = 0;
+    // set when a new segment can not be created; appends are dropped from
+    // then on, while already journaled updates can still be replayed
+    bool disabled_ = false;
+
+    std::map<std::string, td::uint64> offsets_;
+    bool offsets_dirty_ = false;
+};
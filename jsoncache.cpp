@@ -0,0 +1,54 @@
+#include "jsoncache.hpp"
+
+thread_local JsonFragmentCache *JsonFragmentCache::instance_ = nullptr;
+
+void JsonFragmentCache::add_dependent (const Key &key) {
+  if (!open_.empty ()) {
+    auto &dependents = dependents_[key];
+    if (dependents.empty () || !(dependents.back () == open_.back ().key)) {
+      dependents.push_back (open_.back ().key);
+    }
+  }
+}
+
+bool JsonFragmentCache::begin (std::string &out, Kind kind, td::int64 id) {
+  Key key{kind, id};
+  auto it = fragments_.find (key);
+  if (it != fragments_.end ()) {
+    add_dependent (key);
+    out += it->second;
+    return true;
+  }
+  open_.push_back (Open{key, out.size ()});
+  return false;
+}
+
+void JsonFragmentCache::end (std::string &out) {
+  auto open = open_.back ();
+  open_.pop_back ();
+  add_dependent (open.key);
+  if (fragments_.size () >= max_fragments_ && open_.empty ()) {
+    // dropping everything keeps the bookkeeping trivial; the cache refills
+    // from the objects that are actually hot. Only an outermost fragment
+    // gets here, and it is not stored, as the links from the fragments it
+    // embeds are gone with the rest.
+    fragments_.clear ();
+    dependents_.clear ();
+    return;
+  }
+  fragments_[open.key] = out.substr (open.offset);
+}
+
+void JsonFragmentCache::invalidate (Kind kind, td::int64 id) {
+  std::vector<Key> keys{Key{kind, id}};
+  while (!keys.empty ()) {
+    auto key = keys.back ();
+    keys.pop_back ();
+    fragments_.erase (key);
+    auto it = dependents_.find (key);
+    if (it != dependents_.end ()) {
+      keys.insert (keys.end (), it->second.begin (), it->second.end ());
+      dependents_.erase (it);
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "td/utils/common.h"
+
+// Encoded JSON of user, chat and file objects, reused while the object is
+// unchanged. An entry lives until an update about its object invalidates
+// it; fragments that embed another cached object are dropped with it, so a
+// chat goes away when the file of its photo changes.
+class JsonFragmentCache {
+  public:
+    enum class Kind : td::int32 { User, Chat, File };
+
+    // appends the cached fragment and returns true, or starts recording one
+    // that the matching end () stores
+    bool begin (std::string &out, Kind kind, td::int64 id);
+    void end (std::string &out);
+    void invalidate (Kind kind, td::int64 id);
+
+    size_t size () const {
+      return fragments_.size ();
+    }
+
+    // set on the client thread only; encodes on Lua worker threads see null
+    // and bypass the cache
+    static thread_local JsonFragmentCache *instance_;
+
+  private:
+    struct Key {
+      Kind kind;
+      td::int64 id;
+      bool operator== (const Key &other) const {
+        return kind == other.kind && id == other.id;
+      }
+    };
+    struct KeyHash {
+      size_t operator() (const Key &key) const {
+        return std::hash<td::int64> () (key.id * 3 + static_cast<td::int64>(key.kind));
+      }
+    };
+    struct Open {
+      Key key;
+      size_t offset;
+    };
+
+    void add_dependent (const Key &key);
+
+    static constexpr size_t max_fragments_ = 100000;
+    std::unordered_map<Key, std::string, KeyHash> fragments_;
+    std::unordered_map<Key, std::vector<Key>, KeyHash> dependents_;
+    std::vector<Open> open_;
+};
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <cstdlib>
 #include <string>
 #include <getopt.h>
@@ -34,6 +35,8 @@ std::string username;
 std::string groupname;
 std::string unix_socket;
 std::string program;
+std::string journal_dir;
+int journal_max_size = 1024;
 
 bool login_mode;
 bool daemonize;
@@ -43,6 +46,10 @@ int verbosity;
 int sfd = -1;
 int usfd = -1;
 int port = -1;
+int replay_blocks = 0;
+int lua_threads = 0;
+int check_json = 0;
+int commands_per_tick = 100;
 
 td::TdParameters param;
 
@@ -261,6 +268,12 @@ void usage () /* {{{ */ {
   << "  --bot/-b <hash>                      bot mode\n" 
   << "  --phone/-u <phone>                   specify username (would not be asked during authorization)\n"
   << "  --login                              start in login mode\n"
+  << "  --replay-buffer <blocks>             keep last compressed blocks of updates for tdbotResume\n"
+  << "  --journal-dir <dir>                  journal updates to disk for tdbotJournalSubscribe\n"
+  << "  --journal-max-size <MiB>             drop oldest journal segments beyond this size, read or not (default 1024)\n"
+  << "  --lua-threads <n>                    run n Lua states on threads of their own, sharded by chat id\n"
+  << "  --commands-per-tick <n>              commands a connection runs before the next one gets its turn (default 100)\n"
+  << "  --check-json <n>                     repeat every nth encode with ToJson, logging differences and timings\n"
   ;
 
   std::exit (1);
@@ -285,6 +298,12 @@ void args_parse (int argc, char *argv[]) {
     {"phone", required_argument, 0, 'u'},
     {"accept-any-tcp", no_argument, 0,  1001},
     {"login", no_argument, 0,  1002},
+    {"replay-buffer", required_argument, 0,  1003},
+    {"journal-dir", required_argument, 0,  1004},
+    {"journal-max-size", required_argument, 0,  1007},
+    {"lua-threads", required_argument, 0,  1005},
+    {"commands-per-tick", required_argument, 0,  1008},
+    {"check-json", required_argument, 0,  1006},
     {0,         0,                 0,  0 }
   };
 
@@ -350,6 +369,30 @@ void args_parse (int argc, char *argv[]) {
     case 1002:
       login_mode = true;
       break;
+    case 1003:
+      replay_blocks = atoi (optarg);
+      break;
+    case 1004:
+      journal_dir = optarg;
+      break;
+    case 1005:
+      lua_threads = atoi (optarg);
+      break;
+    case 1006:
+      check_json = atoi (optarg);
+      break;
+    case 1007:
+      journal_max_size = atoi (optarg);
+      if (journal_max_size <= 0) {
+        usage ();
+      }
+      break;
+    case 1008:
+      commands_per_tick = atoi (optarg);
+      if (commands_per_tick <= 0) {
+        usage ();
+      }
+      break;
     default:
       usage ();
       break;
@@ -369,6 +412,12 @@ void termination_signal_handler (int signum) {
   std::_Exit (EXIT_FAILURE);
 }
 
+std::atomic<bool> reload_requested (false);
+
+void reload_signal_handler (int signum) {
+  reload_requested = true;
+}
+
 void main_loop() {
   if (logname.length () > 0) {
     static td::FileLog file_log;
@@ -379,12 +428,19 @@ void main_loop() {
   SET_VERBOSITY_LEVEL(VERBOSITY_NAME(FATAL) + verbosity);
 
   td::ConcurrentScheduler scheduler;
-  scheduler.init(4);
+  // Lua workers take the schedulers after the ones TDLib uses
+  scheduler.init(4 + (lua_threads > 0 ? lua_threads : 0));
 
-  scheduler.create_actor_unsafe<CliClient>(0, "CliClient", port, accept_any_tcp_connections ? "0.0.0.0" : "127.0.0.1", lua_script, login_mode, phone, bot_hash, param).release();
+  auto client = scheduler.create_actor_unsafe<CliClient>(0, "CliClient", port, accept_any_tcp_connections ? "0.0.0.0" : "127.0.0.1", lua_script, login_mode, phone, bot_hash, param, replay_blocks, journal_dir, static_cast<size_t>(journal_max_size) << 20, lua_threads, check_json, commands_per_tick).release();
 
   scheduler.start();
-  while (scheduler.run_main(100)) {
+  // run_main takes seconds; a short wait lets a SIGHUP caught on any thread
+  // reach the reload check below without much delay
+  while (scheduler.run_main(0.1)) {
+    if (reload_requested.exchange (false)) {
+      auto guard = scheduler.get_main_guard ();
+      td::send_closure (client, &CliClient::reload_script);
+    }
   }
   scheduler.finish();
 }
@@ -397,6 +453,7 @@ int main (int argc, char *argv[]) {
   td::set_signal_handler (td::SignalType::Error, termination_signal_handler).ensure ();
   td::set_signal_handler (td::SignalType::Quit, termination_signal_handler).ensure ();
   td::ignore_signal (td::SignalType::Pipe).ensure ();
+  td::set_signal_handler (td::SignalType::HangUp, reload_signal_handler).ensure ();
   
   args_parse (argc, argv);
   parse_config ();
@@ -0,0 +1,85 @@
+#include "replayring.hpp"
+
+#include "td/utils/Gzip.h"
+#include "td/utils/logging.h"
+
+void ReplayRing::append (td::uint64 seq, td::Slice update) {
+  if (open_count_ > 0 && open_first_seq_ + open_count_ != seq) {
+    seal ();
+  }
+  if (open_count_ == 0) {
+    open_first_seq_ = seq;
+  }
+  if (first_seq_ == 0) {
+    first_seq_ = seq;
+  }
+  open_.append (update.begin (), update.size ());
+  open_ += '\n';
+  open_count_++;
+
+  if (open_.size () >= BLOCK_SIZE || open_count_ >= BLOCK_UPDATES) {
+    seal ();
+  }
+}
+
+void ReplayRing::seal () {
+  if (open_count_ == 0) {
+    return;
+  }
+  Block block;
+  block.first_seq = open_first_seq_;
+  block.count = open_count_;
+  block.data = td::gzencode (open_, 0.9);
+  block.compressed = !block.data.empty ();
+  if (!block.compressed) {
+    block.data = td::BufferSlice (open_);
+  }
+  blocks_.push_back (std::move (block));
+
+  open_.clear ();
+  open_count_ = 0;
+
+  while (blocks_.size () > max_blocks_) {
+    blocks_.pop_front ();
+  }
+  first_seq_ = blocks_.empty () ? 0 : blocks_.front ().first_seq;
+}
+
+void ReplayRing::replay_lines (td::uint64 first_seq, td::Slice data, td::uint64 seq, const std::function<void (td::uint64, td::Slice)> &f) {
+  auto cur = first_seq;
+  size_t begin = 0;
+  for (size_t i = 0; i < data.size (); i++) {
+    if (data[i] == '\n') {
+      if (cur > seq) {
+        f (cur, data.substr (begin, i - begin));
+      }
+      cur++;
+      begin = i + 1;
+    }
+  }
+}
+
+bool ReplayRing::replay (td::uint64 seq, const std::function<void (td::uint64, td::Slice)> &f) const {
+  bool complete = first_seq_ == 0 || first_seq_ <= seq + 1;
+
+  for (auto &block : blocks_) {
+    if (block.first_seq + block.count <= seq + 1) {
+      continue;
+    }
+    if (block.compressed) {
+      auto data = td::gzdecode (block.data.as_slice ());
+      if (data.empty ()) {
+        LOG(ERROR) << "can not decompress replay block starting at " << block.first_seq;
+        complete = false;
+        continue;
+      }
+      replay_lines (block.first_seq, data.as_slice (), seq, f);
+    } else {
+      replay_lines (block.first_seq, block.data.as_slice (), seq, f);
+    }
+  }
+  if (open_count_ > 0) {
+    replay_lines (open_first_seq_, open_, seq, f);
+  }
+  return complete;
+}
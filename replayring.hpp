@@ -0,0 +1,50 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "td/utils/buffer.h"
+#include "td/utils/common.h"
+#include "td/utils/Slice.h"
+
+// Bounded in-memory history of encoded updates. Updates are appended to an
+// open block, which is gzip-compressed once it is large enough; the oldest
+// compressed block is dropped when more than max_blocks are kept.
+class ReplayRing {
+  public:
+    explicit ReplayRing (size_t max_blocks) : max_blocks_ (max_blocks) {
+    }
+
+    void append (td::uint64 seq, td::Slice update);
+
+    // calls f for every kept update with sequence number greater than seq;
+    // returns false if some of them were already dropped
+    bool replay (td::uint64 seq, const std::function<void (td::uint64, td::Slice)> &f) const;
+
+    bool empty () const {
+      return first_seq_ == 0;
+    }
+
+  private:
+    static constexpr size_t BLOCK_SIZE = 1 << 16;
+    static constexpr size_t BLOCK_UPDATES = 256;
+
+    struct Block {
+      td::uint64 first_seq;
+      size_t count;
+      bool compressed;
+      td::BufferSlice data;
+    };
+
+    void seal ();
+    static void replay_lines (td::uint64 first_seq, td::Slice data, td::uint64 seq, const std::function<void (td::uint64, td::Slice)> &f);
+
+    size_t max_blocks_;
+    td::uint64 first_seq_ = 0;
+    std::deque<Block> blocks_;
+
+    td::uint64 open_first_seq_ = 0;
+    size_t open_count_ = 0;
+    std::string open_;
+};
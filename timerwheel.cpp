@@ -0,0 +1,70 @@
+#include "timerwheel.hpp"
+
+void TimerWheel::add (double now, double at, td::uint64 id) {
+  auto due = to_tick (at);
+  if (!started_) {
+    started_ = true;
+    current_tick_ = to_tick (now);
+  }
+  if (due <= current_tick_) {
+    due = current_tick_ + 1;
+  }
+  insert (Entry{due, id});
+  size_++;
+}
+
+void TimerWheel::insert (Entry entry) {
+  auto delta = entry.due - current_tick_;
+  for (int level = 0; level < LEVELS; level++) {
+    if (delta < (static_cast<td::int64>(1) << (BITS * (level + 1))) || level == LEVELS - 1) {
+      auto slot = (entry.due >> (BITS * level)) & (SLOTS - 1);
+      slots_[level][slot].push_back (entry);
+      return;
+    }
+  }
+}
+
+void TimerWheel::cascade (int level) {
+  auto slot = (current_tick_ >> (BITS * level)) & (SLOTS - 1);
+  std::vector<Entry> entries;
+  std::swap (entries, slots_[level][slot]);
+  for (auto &entry : entries) {
+    insert (entry);
+  }
+}
+
+void TimerWheel::advance (double now, std::vector<td::uint64> &expired) {
+  auto target = to_tick (now);
+  if (size_ == 0) {
+    started_ = false;
+    return;
+  }
+
+  while (current_tick_ < target && size_ > 0) {
+    current_tick_++;
+
+    int top = 0;
+    while (top + 1 < LEVELS && (current_tick_ & ((static_cast<td::int64>(1) << (BITS * (top + 1))) - 1)) == 0) {
+      top++;
+    }
+    for (int level = top; level >= 1; level--) {
+      cascade (level);
+    }
+
+    auto &slot = slots_[0][current_tick_ & (SLOTS - 1)];
+    size_t j = 0;
+    for (auto &entry : slot) {
+      if (entry.due <= current_tick_) {
+        expired.push_back (entry.id);
+        size_--;
+      } else {
+        slot[j++] = entry;
+      }
+    }
+    slot.resize (j);
+  }
+
+  if (size_ == 0) {
+    started_ = false;
+  }
+}
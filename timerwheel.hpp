@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+
+#include "td/utils/common.h"
+
+// Hierarchical timer wheel: 4 levels of 64 slots each, so a deadline is
+// touched at most once per level before it fires. Entries are never removed
+// early; owners drop stale ids when they come out of advance ().
+class TimerWheel {
+  public:
+    explicit TimerWheel (double tick) : tick_ (tick) {
+    }
+
+    void add (double now, double at, td::uint64 id);
+    void advance (double now, std::vector<td::uint64> &expired);
+
+    bool empty () const {
+      return size_ == 0;
+    }
+    double tick () const {
+      return tick_;
+    }
+
+  private:
+    static constexpr int BITS = 6;
+    static constexpr int SLOTS = 1 << BITS;
+    static constexpr int LEVELS = 4;
+
+    struct Entry {
+      td::int64 due;
+      td::uint64 id;
+    };
+
+    td::int64 to_tick (double at) const {
+      return static_cast<td::int64>(at / tick_);
+    }
+    void insert (Entry entry);
+    void cascade (int level);
+
+    double tick_;
+    bool started_ = false;
+    td::int64 current_tick_ = 0;
+    size_t size_ = 0;
+    std::vector<Entry> slots_[LEVELS][SLOTS];
+};